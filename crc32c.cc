@@ -0,0 +1,85 @@
+// CRC32C, in hardware where possible.
+
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#define POLY 0x82f63b78  // reflected Castagnoli polynomial
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void
+init_table()
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+    table[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int t = 1; t < 8; t++)
+      table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+}
+
+// Slicing-by-8: eight table lookups fold in eight bytes at a time.
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  pthread_once(&table_once, init_table);
+  for (; len > 0 && ((uintptr_t) p & 7); len--)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    w ^= crc;
+    crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+          table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+          table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+          table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+  }
+  for (; len > 0; len--)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc;
+  for (; len > 0 && ((uintptr_t) p & 7); len--)
+    c = __builtin_ia32_crc32qi((uint32_t) c, *p++);
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    c = __builtin_ia32_crc32di(c, w);
+  }
+  for (; len > 0; len--)
+    c = __builtin_ia32_crc32qi((uint32_t) c, *p++);
+  return (uint32_t) c;
+}
+
+static bool
+have_sse42()
+{
+  static int have = -1;
+  if (have < 0)
+    have = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  return have;
+}
+#endif
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (have_sse42())
+    return ~crc32c_hw(crc, p, len);
+#endif
+  return ~crc32c_sw(crc, p, len);
+}
@@ -0,0 +1,14 @@
+// CRC32C (Castagnoli), used for block checksums.
+
+#ifndef crc32c_h
+#define crc32c_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Checksum len bytes at buf, continuing from crc (0 to start).
+// Uses the SSE4.2 crc32 instruction when the CPU has it and
+// slicing-by-8 tables otherwise.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -1,11 +1,25 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "slock.h"
+#include "method_thread.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <algorithm>
+
+// What a cached page counts against the budget
+#define PAGE_CHARGE (sizeof(extent_client::cached_page) + EXTENT_PAGE)
+
+// The number of pages a file of size bytes spans
+static inline uint32_t
+npages(unsigned int size)
+{
+  return (size + EXTENT_PAGE - 1) / EXTENT_PAGE;
+}
 
 extent_client::extent_client(std::string dst)
 {
@@ -15,6 +29,490 @@ extent_client::extent_client(std::string dst)
   if (cl->bind() != 0) {
     printf("extent_client: bind failed\n");
   }
+  pthread_mutex_init(&cache_mutex, NULL);
+  budget = EXTENT_CACHE_BYTES;
+  char *budget_env = getenv("EXTENT_CACHE_KB");
+  if (budget_env != NULL)
+    budget = (size_t) atoi(budget_env) * 1024;
+  cache_bytes = 0;
+  hand = page_key(0, 0);
+  hits = misses = evictions = writebacks = readaheads = 0;
+  pthread_cond_init(&flush_cond, NULL);
+  pthread_cond_init(&flush_done, NULL);
+  dirty_expire = EXTENT_DIRTY_EXPIRE;
+  char *expire_env = getenv("EXTENT_DIRTY_EXPIRE");
+  if (expire_env != NULL)
+    dirty_expire = atoi(expire_env);
+  dirty_background = EXTENT_DIRTY_BACKGROUND_BYTES;
+  char *background_env = getenv("EXTENT_DIRTY_BACKGROUND_KB");
+  if (background_env != NULL)
+    dirty_background = (size_t) atoi(background_env) * 1024;
+  dirty_bytes = 0;
+  pthread_cond_init(&ra_cond, NULL);
+  pthread_cond_init(&ra_done, NULL);
+  readahead_max = EXTENT_READAHEAD_BYTES;
+  char *readahead_env = getenv("EXTENT_READAHEAD_KB");
+  if (readahead_env != NULL)
+    readahead_max = (size_t) atoi(readahead_env) * 1024;
+  stamps = 0;
+  stats_interval = 0;
+  char *stats_env = getenv("EXTENT_CACHE_STATS");
+  if (stats_env != NULL)
+    stats_interval = atoi(stats_env);
+  stats_due = time(NULL) + stats_interval;
+  method_thread(this, true, &extent_client::flusher);
+  method_thread(this, true, &extent_client::reader);
+}
+
+void
+extent_client::set_cache_budget(size_t bytes)
+{
+  ScopedLock ml(&cache_mutex);
+  budget = bytes;
+  evict();
+}
+
+size_t
+extent_client::cached_bytes()
+{
+  ScopedLock ml(&cache_mutex);
+  return cache_bytes;
+}
+
+extent_client::cache_stats
+extent_client::stats()
+{
+  ScopedLock ml(&cache_mutex);
+  cache_stats st;
+  st.hits = hits;
+  st.misses = misses;
+  st.evictions = evictions;
+  st.writebacks = writebacks;
+  st.readaheads = readaheads;
+  return st;
+}
+
+// Print the cache counters. Called with cache_mutex held.
+void
+extent_client::print_stats()
+{
+  printf("extent_client: %llu hits %llu misses %llu evictions %llu writebacks "
+         "%llu readaheads, %zu bytes cached\n",
+         (unsigned long long) hits, (unsigned long long) misses,
+         (unsigned long long) evictions, (unsigned long long) writebacks,
+         (unsigned long long) readaheads, cache_bytes);
+  fflush(stdout);
+}
+
+// The cached file eid, or NULL.
+extent_client::cached_file_p
+extent_client::find_file(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, cached_file_p>::iterator it = cache.find(eid);
+  if (it == cache.end())
+    return NULL;
+  return it->second;
+}
+
+// The cached file eid, made empty if there was none.
+extent_client::cached_file_p
+extent_client::insert_file(extent_protocol::extentid_t eid)
+{
+  cached_file_p file = find_file(eid);
+  if (file == NULL) {
+    file = new cached_file();
+    file->stamp = ++stamps;
+    cache[eid] = file;
+    cache_bytes += sizeof(cached_file);
+  }
+  return file;
+}
+
+// Forget file eid and its pages, dirty or not.
+void
+extent_client::drop_file(extent_protocol::extentid_t eid)
+{
+  drop_pages(eid, 0);
+  std::map<extent_protocol::extentid_t, cached_file_p>::iterator it = cache.find(eid);
+  if (it == cache.end())
+    return;
+  delete it->second;
+  cache.erase(it);
+  cache_bytes -= sizeof(cached_file);
+}
+
+// The cached page index of file eid, or NULL. Marks it used.
+extent_client::cached_page_p
+extent_client::find_page(extent_protocol::extentid_t eid, uint32_t index)
+{
+  std::map<page_key, cached_page_p>::iterator it = pages.find(page_key(eid, index));
+  if (it == pages.end())
+    return NULL;
+  it->second->referenced = true;
+  return it->second;
+}
+
+// The cached page index of file eid, zeroed if there was none.
+extent_client::cached_page_p
+extent_client::insert_page(extent_protocol::extentid_t eid, uint32_t index)
+{
+  cached_page_p page = find_page(eid, index);
+  if (page == NULL) {
+    page = new cached_page();
+    pages[page_key(eid, index)] = page;
+    cache_bytes += PAGE_CHARGE;
+  }
+  return page;
+}
+
+// Forget the pages of file eid from index from on.
+void
+extent_client::drop_pages(extent_protocol::extentid_t eid, uint32_t from)
+{
+  std::map<page_key, cached_page_p>::iterator it = pages.lower_bound(page_key(eid, from));
+  while (it != pages.end() && it->first.first == eid) {
+    if (it->second->dirty)
+      dirty_bytes -= EXTENT_PAGE;
+    delete it->second;
+    pages.erase(it++);
+    cache_bytes -= PAGE_CHARGE;
+  }
+}
+
+// Mark file as holding changes the server has yet to see.
+void
+extent_client::dirty_file(cached_file_p file)
+{
+  if (file->dirty)
+    return;
+  file->dirty = true;
+  file->dirtied = time(NULL);
+}
+
+// Mark page of file as changed, waking the flusher when dirty pages
+// pass the background threshold.
+void
+extent_client::dirty_page(cached_file_p file, cached_page_p page)
+{
+  dirty_file(file);
+  if (page->dirty)
+    return;
+  page->dirty = true;
+  dirty_bytes += EXTENT_PAGE;
+  if (dirty_bytes > dirty_background)
+    pthread_cond_signal(&flush_cond);
+}
+
+// Whether every page holding bytes [off, off + len) of file eid is cached.
+bool
+extent_client::have_range(extent_protocol::extentid_t eid, unsigned int off, unsigned int len)
+{
+  if (len == 0)
+    return true;
+  for (uint32_t i = off / EXTENT_PAGE; i <= (off + len - 1) / EXTENT_PAGE; i++)
+    if (pages.find(page_key(eid, i)) == pages.end())
+      return false;
+  return true;
+}
+
+// Gather bytes [off, off + len) of file eid from its cached pages.
+void
+extent_client::copy_range(extent_protocol::extentid_t eid, unsigned int off, unsigned int len,
+                          std::string &buf)
+{
+  buf.erase();
+  buf.reserve(len);
+  unsigned int end = off + len;
+  while (off < end) {
+    cached_page_p page = find_page(eid, off / EXTENT_PAGE);
+    unsigned int in = off % EXTENT_PAGE;
+    unsigned int n = std::min(end - off, EXTENT_PAGE - in);
+    buf.append(page->data, in, n);
+    off += n;
+  }
+}
+
+// Cache pages [from, to) of file eid that are not cached yet from buf,
+// the server's bytes from page from on. Bytes the server holds stale
+// or lacks read as zeros.
+void
+extent_client::fill_pages(extent_protocol::extentid_t eid, cached_file_p file,
+                          uint32_t from, uint32_t to, const std::string &buf)
+{
+  unsigned int valid = std::min(file->trunc_to, file->attr.size);
+  for (uint32_t i = from; i < to; i++) {
+    if (pages.count(page_key(eid, i)))
+      continue;
+    cached_page_p page = insert_page(eid, i);
+    size_t pos = (size_t) (i - from) * EXTENT_PAGE;
+    size_t n = 0;
+    if (pos < buf.size())
+      n = std::min(buf.size() - pos, (size_t) EXTENT_PAGE);
+    if ((size_t) i * EXTENT_PAGE + n > valid)
+      n = valid > (size_t) i * EXTENT_PAGE ? valid - (size_t) i * EXTENT_PAGE : 0;
+    if (n > 0)
+      page->data.replace(0, n, buf, pos, n);
+  }
+}
+
+// Take a as what the server holds for file.
+void
+extent_client::set_attr(cached_file_p file, const extent_protocol::attr &a)
+{
+  file->attr = a;
+  file->attr_valid = true;
+  file->server_size = file->trunc_to = a.size;
+}
+
+// Make sure the attributes of file eid are cached and point file at it.
+extent_protocol::status
+extent_client::fetch_attr(extent_protocol::extentid_t eid, cached_file_p &file)
+{
+  file = find_file(eid);
+  if (file != NULL && file->attr_valid)
+    return extent_protocol::OK;
+  extent_protocol::attr a;
+  extent_protocol::status ret = cl->call(extent_protocol::getattr, eid, a);
+  if (ret != extent_protocol::OK)
+    return ret;
+  file = insert_file(eid);
+  set_attr(file, a);
+  return ret;
+}
+
+// Cache the pages holding bytes [off, off + len) of file eid, reading
+// those missing in one RPC. A page not cached has no changes of ours,
+// so the server's copy stands below trunc_to.
+extent_protocol::status
+extent_client::fetch_range(extent_protocol::extentid_t eid, cached_file_p file,
+                           unsigned int off, unsigned int len)
+{
+  uint32_t first = off / EXTENT_PAGE;
+  uint32_t last = (off + len - 1) / EXTENT_PAGE;
+  while (first <= last && pages.count(page_key(eid, first)))
+    first++;
+  while (last > first && pages.count(page_key(eid, last)))
+    last--;
+  if (first > last)
+    return extent_protocol::OK;
+  std::string buf;
+  extent_protocol::status ret = cl->call(extent_protocol::read_range, eid,
+                                         first * EXTENT_PAGE,
+                                         (last - first + 1) * EXTENT_PAGE, buf);
+  if (ret != extent_protocol::OK)
+    return ret;
+  fill_pages(eid, file, first, last + 1, buf);
+  return ret;
+}
+
+// Copy the changes to file eid into job and mark its pages clean. A
+// file mostly dirty and wholly cached goes as one put; otherwise the
+// server cuts the file to trunc_to, takes each run of dirty pages and
+// then the new size.
+void
+extent_client::begin_writeback(extent_protocol::extentid_t eid, cached_file_p file,
+                               writeback_job &job)
+{
+  writebacks++;
+  uint32_t n = npages(file->attr.size);
+  uint32_t cached = 0, dirty = 0;
+  std::map<page_key, cached_page_p>::iterator first = pages.lower_bound(page_key(eid, 0));
+  std::map<page_key, cached_page_p>::iterator it;
+  for (it = first; it != pages.end() && it->first.first == eid; ++it) {
+    cached++;
+    if (it->second->dirty)
+      dirty++;
+  }
+  job.server_size = file->server_size;
+  job.trunc_to = file->trunc_to;
+  job.size = file->attr.size;
+  job.whole = cached == n && 2 * dirty >= n;
+  if (job.whole)
+    copy_range(eid, 0, file->attr.size, job.buf);
+  it = first;
+  while (it != pages.end() && it->first.first == eid) {
+    if (!it->second->dirty) {
+      ++it;
+      continue;
+    }
+    uint32_t start = it->first.second, next = start;
+    std::string buf;
+    do {
+      if (!job.whole)
+        buf += it->second->data;
+      job.cleaned.push_back(next++);
+      it->second->dirty = false;
+      dirty_bytes -= EXTENT_PAGE;
+      ++it;
+    } while (it != pages.end() && it->first.first == eid &&
+             it->first.second == next && it->second->dirty);
+    if (job.whole)
+      continue;
+    unsigned int off = start * EXTENT_PAGE;
+    buf.resize(std::min((unsigned int) buf.size(), file->attr.size - off));
+    job.runs.push_back(std::make_pair(off, buf));
+  }
+  file->dirty = false;
+  file->cut_to = file->attr.size;
+  file->stamp = ++stamps;
+}
+
+// Send the changes a writeback copied. Touches no cache state.
+extent_protocol::status
+extent_client::send_writeback(extent_protocol::extentid_t eid, const writeback_job &job)
+{
+  extent_protocol::status ret;
+  int r;
+  if (job.whole)
+    return cl->call(extent_protocol::put, eid, job.buf, r);
+  unsigned int server_size = job.server_size;
+  if (job.trunc_to < server_size) {
+    ret = cl->call(extent_protocol::truncate, eid, job.trunc_to, r);
+    if (ret != extent_protocol::OK)
+      return ret;
+    server_size = job.trunc_to;
+  }
+  for (size_t i = 0; i < job.runs.size(); i++) {
+    unsigned int off = job.runs[i].first;
+    ret = cl->call(extent_protocol::write_range, eid, off, job.runs[i].second, r);
+    if (ret != extent_protocol::OK)
+      return ret;
+    server_size = std::max(server_size, off + (unsigned int) job.runs[i].second.size());
+  }
+  if (server_size != job.size)
+    return cl->call(extent_protocol::truncate, eid, job.size, r);
+  return extent_protocol::OK;
+}
+
+// Take the outcome of a writeback. The server now holds the file as
+// it was copied, except where it was cut since; a failed writeback
+// leaves its pages dirty again, and the server's size unknown up to
+// the largest it may have reached.
+void
+extent_client::end_writeback(extent_protocol::extentid_t eid, cached_file_p file,
+                             const writeback_job &job, extent_protocol::status ret)
+{
+  file->stamp = ++stamps;
+  if (ret == extent_protocol::OK) {
+    file->server_size = job.size;
+    file->trunc_to = std::min(file->cut_to, job.size);
+    return;
+  }
+  dirty_file(file);
+  for (size_t i = 0; i < job.cleaned.size(); i++) {
+    cached_page_p page = find_page(eid, job.cleaned[i]);
+    if (page != NULL)
+      dirty_page(file, page);
+  }
+  file->server_size = std::max(file->server_size, job.size);
+}
+
+// Send the changes to file eid to the server, holding cache_mutex.
+extent_protocol::status
+extent_client::writeback(extent_protocol::extentid_t eid, cached_file_p file)
+{
+  if (!file->dirty)
+    return extent_protocol::OK;
+  writeback_job job;
+  begin_writeback(eid, file, job);
+  extent_protocol::status ret = send_writeback(eid, job);
+  end_writeback(eid, file, job, ret);
+  return ret;
+}
+
+// Wait until the flusher is done with file eid. Return the cached
+// file, or NULL if there is none.
+extent_client::cached_file_p
+extent_client::settle_file(extent_protocol::extentid_t eid)
+{
+  cached_file_p file;
+  while ((file = find_file(eid)) != NULL && file->flushing)
+    pthread_cond_wait(&flush_done, &cache_mutex);
+  return file;
+}
+
+// Evict pages in CLOCK order until the cache fits its budget. The hand
+// gives a page used since it last passed a second chance. A dirty page
+// has its file written back first. The pages of a file the flusher
+// is sending stay, to be dirtied again should it fail. Run at the end
+// of each call only, so pages in use stay put.
+void
+extent_client::evict()
+{
+  size_t busy = 0;
+  while (cache_bytes > budget && !pages.empty()) {
+    std::map<page_key, cached_page_p>::iterator it = pages.upper_bound(hand);
+    if (it == pages.end())
+      it = pages.begin();
+    hand = it->first;
+    cached_page_p page = it->second;
+    cached_file_p owner = find_file(hand.first);
+    if (owner != NULL && owner->flushing) {
+      if (++busy > pages.size())
+        return;
+      continue;
+    }
+    if (page->referenced) {
+      page->referenced = false;
+      continue;
+    }
+    if (page->dirty && writeback(hand.first, find_file(hand.first)) != extent_protocol::OK) {
+      printf("extent_client: writeback of %llu failed\n", (unsigned long long) hand.first);
+      return;
+    }
+    evictions++;
+    busy = 0;
+    delete page;
+    pages.erase(it);
+    cache_bytes -= PAGE_CHARGE;
+  }
+}
+
+// Write back dirty files in the background, so that a revocation
+// finds little left to send. A file goes once it has been dirty for
+// dirty_expire seconds, or oldest first while more than
+// dirty_background bytes are dirty. The changes are copied out under
+// cache_mutex and sent without it, like a readahead, so that other
+// calls go on meanwhile; those that would drop the file wait for it.
+// It also prints the cache counters every stats_interval seconds.
+void
+extent_client::flusher()
+{
+  ScopedLock ml(&cache_mutex);
+  while (true) {
+    if (stats_interval > 0 && time(NULL) >= stats_due) {
+      print_stats();
+      stats_due = time(NULL) + stats_interval;
+    }
+    extent_protocol::extentid_t eid = 0;
+    cached_file_p oldest = NULL;
+    std::map<extent_protocol::extentid_t, cached_file_p>::iterator it;
+    for (it = cache.begin(); it != cache.end(); ++it)
+      if (it->second->dirty && (oldest == NULL || it->second->dirtied < oldest->dirtied)) {
+        eid = it->first;
+        oldest = it->second;
+      }
+    if (oldest != NULL &&
+        (dirty_bytes > dirty_background || time(NULL) - oldest->dirtied >= dirty_expire)) {
+      writeback_job job;
+      begin_writeback(eid, oldest, job);
+      oldest->flushing = true;
+      pthread_mutex_unlock(&cache_mutex);
+      extent_protocol::status ret = send_writeback(eid, job);
+      pthread_mutex_lock(&cache_mutex);
+      oldest->flushing = false;
+      end_writeback(eid, oldest, job, ret);
+      pthread_cond_broadcast(&flush_done);
+      evict();
+      if (ret == extent_protocol::OK)
+        continue;
+      printf("extent_client: writeback of %llu failed\n", (unsigned long long) eid);
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&flush_cond, &cache_mutex, &deadline);
+  }
 }
 
 // a demo to show how to use RPC
@@ -22,18 +520,20 @@ extent_protocol::status
 extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  cached_file_p new_file = (cached_file_p) new cached_file();
-  new_file->buf_valid = true;
-  new_file->attr_valid = true;
-  new_file->type = type;
-  new_file->attr.atime = time(NULL);
-  new_file->attr.ctime = time(NULL);
-  new_file->attr.mtime = time(NULL);
-  new_file->attr.type = type;
+  ScopedLock ml(&cache_mutex);
   ret = cl->call(extent_protocol::create, type, id);
-  if (cache[id] != NULL)
-    delete cache[id];
-  cache[id] = new_file;
+  if (ret != extent_protocol::OK)
+    return ret;
+  drop_file(id);
+  cached_file_p new_file = insert_file(id);
+  extent_protocol::attr a;
+  a.atime = time(NULL);
+  a.ctime = time(NULL);
+  a.mtime = time(NULL);
+  a.type = type;
+  a.size = 0;
+  new_file->type = type;
+  set_attr(new_file, a);
   // Your lab2 part1 code goes here
   return ret;
 }
@@ -43,24 +543,31 @@ extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
   // Your lab2 part1 code goes here
-  cached_file_p file = cache[eid];
+  ScopedLock ml(&cache_mutex);
+  cached_file_p file = find_file(eid);
   // cache hit
-  if (file != NULL && file->buf_valid) {
-    buf = file->buf;
+  if (file != NULL && file->attr_valid && have_range(eid, 0, file->attr.size)) {
+    hits++;
+    copy_range(eid, 0, file->attr.size, buf);
+    evict();
     return ret;
   }
   // cache miss
-  if (file == NULL)
-    file = (cached_file_p) new cached_file();
-  
+  misses++;
   extent_protocol::full_file server_file;
   ret = cl->call(extent_protocol::get, eid, server_file);
-  file->buf = server_file.buf;
-  file->buf_valid = true;
-  file->attr = server_file.attr;
-  file->attr_valid = true;
-  cache[eid] = file;
-  buf = cache[eid]->buf;
+  if (ret != extent_protocol::OK)
+    return ret;
+  file = insert_file(eid);
+  // the server's size is in flux while the flusher sends the file
+  if (!file->dirty && !file->flushing) {
+    if (file->attr_valid && file->attr.size != server_file.attr.size)
+      drop_pages(eid, 0);
+    set_attr(file, server_file.attr);
+  }
+  fill_pages(eid, file, 0, npages(file->attr.size), server_file.buf);
+  copy_range(eid, 0, file->attr.size, buf);
+  evict();
   return ret;
 }
 
@@ -69,62 +576,372 @@ extent_client::getattr(extent_protocol::extentid_t eid,
 		       extent_protocol::attr &attr)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  cached_file_p file = cache[eid];
+  ScopedLock ml(&cache_mutex);
+  cached_file_p file = find_file(eid);
   // cache hit
   if (file != NULL && file->attr_valid) {
+    hits++;
     attr = file->attr;
     return ret;
   }
   // cache miss
-  if (file == NULL)
-    file = (cached_file_p) new cached_file();
-
-  extent_protocol::full_file server_file;
-  ret = cl->call(extent_protocol::getattr, eid, server_file);
-  file->attr = server_file.attr;
-  file->attr_valid = true;
-  file->buf = server_file.buf;
-  file->buf_valid = true;
-  cache[eid] = file;
-  attr = cache[eid]->attr;
+  misses++;
+  ret = fetch_attr(eid, file);
+  if (ret == extent_protocol::OK)
+    attr = file->attr;
   return ret;
 }
 
+// Store buf as the whole of file eid, dirtying only the pages it
+// changes.
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  cached_file_p file = cache[eid];
-  if (file == NULL)
-    file = (cached_file_p) new cached_file();
-  
-  file->dirty = true;
-  file->buf_valid = true;
-  file->buf = buf;
+  ScopedLock ml(&cache_mutex);
+  cached_file_p file;
+  ret = fetch_attr(eid, file);
+  if (ret != extent_protocol::OK)
+    return ret;
+  unsigned int size = buf.size();
+  if (size < file->attr.size) {
+    drop_pages(eid, npages(size));
+    file->trunc_to = std::min(file->trunc_to, size);
+    file->cut_to = std::min(file->cut_to, size);
+  }
+  if (size != file->attr.size)
+    dirty_file(file);
+  for (uint32_t i = 0; i < npages(size); i++) {
+    std::string data(buf, (size_t) i * EXTENT_PAGE, EXTENT_PAGE);
+    data.resize(EXTENT_PAGE, '\0');
+    cached_page_p page = find_page(eid, i);
+    if (page != NULL && page->data == data)
+      continue;
+    if (page == NULL)
+      page = insert_page(eid, i);
+    page->data.swap(data);
+    dirty_page(file, page);
+  }
   file->attr.atime = time(NULL);
   file->attr.ctime = time(NULL);
   file->attr.mtime = time(NULL);
-  file->attr.size = buf.size();
-  
-  cache[eid] = file;
+  file->attr.size = size;
+  evict();
   // Your lab2 part1 code goes here
   // int r;
   // ret = cl->call(extent_protocol::put, eid, buf,r);
   return ret;
 }
 
+// Serve the range from cached pages, reading the missing ones from the
+// server first unless a readahead already is.
 extent_protocol::status
-extent_client::remove(extent_protocol::extentid_t eid)
+extent_client::read_range(extent_protocol::extentid_t eid, unsigned int off,
+                          unsigned int len, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  // Your lab2 part1 code goes here
-  std::map<extent_protocol::extentid_t, cached_file_p>::iterator iter;
-  for(iter = cache.begin(); iter != cache.end(); iter++) {
-    if (iter->first == eid) {
-      cache.erase(iter);
+  ScopedLock ml(&cache_mutex);
+  cached_file_p file;
+  while (true) {
+    ret = fetch_attr(eid, file);
+    if (ret != extent_protocol::OK)
+      return ret;
+    if (off >= file->attr.size) {
+      hits++;
+      buf.erase();
+      return ret;
+    }
+    len = std::min(len, file->attr.size - off);
+    // cache hit
+    if (have_range(eid, off, len)) {
+      hits++;
       break;
     }
+    if (file->ra_pending > 0 && off < file->ra_end && off + len > file->ra_start) {
+      pthread_cond_wait(&ra_done, &cache_mutex);
+      continue;
+    }
+    // cache miss
+    misses++;
+    ret = fetch_range(eid, file, off, len);
+    if (ret != extent_protocol::OK)
+      return ret;
+    break;
+  }
+  read_ahead(eid, file, off, len);
+  copy_range(eid, off, len, buf);
+  evict();
+  return ret;
+}
+
+// Note a read of [off, off + len) of file eid. A read that starts
+// where the last one ended is sequential and doubles the window, up
+// to readahead_max or a quarter of the budget; any other read closes
+// it. Once less than half a window lies read ahead, the rest of the
+// window goes to the readahead thread.
+void
+extent_client::read_ahead(extent_protocol::extentid_t eid, cached_file_p file,
+                          unsigned int off, unsigned int len)
+{
+  bool sequential = off == file->ra_next;
+  file->ra_next = off + len;
+  size_t most = std::min(readahead_max, budget / 4);
+  if (!sequential || most < EXTENT_PAGE) {
+    file->ra_window = 0;
+    file->ra_end = 0;
+    return;
   }
+  if (file->ra_window == 0)
+    file->ra_window = std::max(2 * len, 4u * EXTENT_PAGE);
+  else
+    file->ra_window *= 2;
+  file->ra_window = std::min((size_t) file->ra_window, most);
+  unsigned int end = off + len;
+  if (file->ra_end >= end + file->ra_window / 2)
+    return;
+  unsigned int from = std::max(end, file->ra_end);
+  unsigned int to = std::min(end + file->ra_window, file->attr.size);
+  if (from >= to)
+    return;
+  readahead r;
+  r.eid = eid;
+  r.off = from;
+  r.len = to - from;
+  r.stamp = file->stamp;
+  ra_queue.push_back(r);
+  if (file->ra_pending++ == 0)
+    file->ra_start = from;
+  file->ra_end = to;
+  pthread_cond_signal(&ra_cond);
+}
+
+// Carry out queued readaheads, reading without cache_mutex held so
+// that other calls go on meanwhile. The pages read are cached only if
+// the server's copy of the file has not moved on since the readahead
+// was queued; pages cached meanwhile are left alone.
+void
+extent_client::reader()
+{
+  ScopedLock ml(&cache_mutex);
+  while (true) {
+    while (ra_queue.empty())
+      pthread_cond_wait(&ra_cond, &cache_mutex);
+    readahead r = ra_queue.front();
+    ra_queue.pop_front();
+    ra_fill(r);
+    cached_file_p file = find_file(r.eid);
+    if (file != NULL && file->ra_pending > 0)
+      file->ra_pending--;
+    pthread_cond_broadcast(&ra_done);
+    evict();
+  }
+}
+
+// Read the pages readahead r is after and are not cached yet.
+void
+extent_client::ra_fill(const readahead &r)
+{
+  cached_file_p file = find_file(r.eid);
+  if (file == NULL || file->stamp != r.stamp || !file->attr_valid)
+    return;
+  unsigned int end = std::min(r.off + r.len, file->attr.size);
+  if (r.off >= end)
+    return;
+  uint32_t first = r.off / EXTENT_PAGE;
+  uint32_t last = (end - 1) / EXTENT_PAGE;
+  while (first <= last && pages.count(page_key(r.eid, first)))
+    first++;
+  while (last > first && pages.count(page_key(r.eid, last)))
+    last--;
+  if (first > last)
+    return;
+  readaheads++;
+  std::string buf;
+  pthread_mutex_unlock(&cache_mutex);
+  extent_protocol::status ret = cl->call(extent_protocol::read_range, r.eid,
+                                         first * EXTENT_PAGE,
+                                         (last - first + 1) * EXTENT_PAGE, buf);
+  pthread_mutex_lock(&cache_mutex);
+  file = find_file(r.eid);
+  if (ret == extent_protocol::OK && file != NULL && file->stamp == r.stamp &&
+      file->attr_valid)
+    fill_pages(r.eid, file, first, std::min(last + 1, npages(file->attr.size)), buf);
+}
+
+// Write into the cached pages. Only a page the write covers in part
+// and that holds bytes of the file is read from the server first.
+extent_protocol::status
+extent_client::write_range(extent_protocol::extentid_t eid, unsigned int off,
+                           std::string buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ScopedLock ml(&cache_mutex);
+  cached_file_p file;
+  ret = fetch_attr(eid, file);
+  if (ret != extent_protocol::OK || buf.empty())
+    return ret;
+  unsigned int end = off + buf.size();
+  uint32_t first = off / EXTENT_PAGE;
+  uint32_t last = (end - 1) / EXTENT_PAGE;
+  bool miss = false;
+  if (off % EXTENT_PAGE && first * EXTENT_PAGE < file->attr.size &&
+      find_page(eid, first) == NULL) {
+    miss = true;
+    ret = fetch_range(eid, file, first * EXTENT_PAGE, 1);
+  }
+  if (ret == extent_protocol::OK && end % EXTENT_PAGE && end < file->attr.size &&
+      find_page(eid, last) == NULL) {
+    miss = true;
+    ret = fetch_range(eid, file, last * EXTENT_PAGE, 1);
+  }
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (miss)
+    misses++;
+  else
+    hits++;
+  unsigned int pos = off;
+  while (pos < end) {
+    cached_page_p page = insert_page(eid, pos / EXTENT_PAGE);
+    unsigned int in = pos % EXTENT_PAGE;
+    unsigned int n = std::min(end - pos, EXTENT_PAGE - in);
+    page->data.replace(in, n, buf, pos - off, n);
+    dirty_page(file, page);
+    pos += n;
+  }
+  file->attr.ctime = time(NULL);
+  file->attr.mtime = time(NULL);
+  if (end > file->attr.size)
+    file->attr.size = end;
+  evict();
+  return ret;
+}
+
+// Resize the cached file if there is one, otherwise have the server
+// resize the file in place.
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, unsigned int size)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ScopedLock ml(&cache_mutex);
+  cached_file_p file = find_file(eid);
+  // cache hit
+  if (file != NULL && file->attr_valid) {
+    hits++;
+    if (size < file->attr.size) {
+      drop_pages(eid, npages(size));
+      cached_page_p page = find_page(eid, size / EXTENT_PAGE);
+      if (page != NULL)
+        page->data.replace(size % EXTENT_PAGE, EXTENT_PAGE - size % EXTENT_PAGE,
+                           EXTENT_PAGE - size % EXTENT_PAGE, '\0');
+      file->trunc_to = std::min(file->trunc_to, size);
+      file->cut_to = std::min(file->cut_to, size);
+    }
+    dirty_file(file);
+    file->attr.ctime = time(NULL);
+    file->attr.mtime = time(NULL);
+    file->attr.size = size;
+    evict();
+    return ret;
+  }
+  // cache miss
+  misses++;
+  int r;
+  ret = cl->call(extent_protocol::truncate, eid, size, r);
+  return ret;
+}
+
+// Send ops to the server as one compound call and return a result
+// per step, keeping the cache in step with what they did. Files the
+// ops name go to the server first if dirty.
+extent_protocol::status
+extent_client::compound(std::vector<extent_protocol::op> &ops,
+                        std::vector<extent_protocol::result> &results)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ScopedLock ml(&cache_mutex);
+  // none of them may be in flight meanwhile
+  for (size_t i = 0; i < ops.size(); ) {
+    cached_file_p file = find_file(ops[i].id);
+    if (file != NULL && file->flushing) {
+      pthread_cond_wait(&flush_done, &cache_mutex);
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+  for (size_t i = 0; i < ops.size(); i++) {
+    cached_file_p file = find_file(ops[i].id);
+    if (file != NULL) {
+      ret = writeback(ops[i].id, file);
+      if (ret != extent_protocol::OK)
+        return ret;
+    }
+  }
+  ret = cl->call(extent_protocol::compound, ops, results);
+  if (ret != extent_protocol::OK)
+    return ret;
+  for (size_t i = 0; i < ops.size() && i < results.size(); i++) {
+    extent_protocol::op &o = ops[i];
+    extent_protocol::result &res = results[i];
+    if (res.ret != extent_protocol::OK)
+      continue;
+    if (o.code == extent_protocol::remove) {
+      drop_file(res.id);
+      continue;
+    }
+    cached_file_p file = insert_file(res.id);
+    file->stamp = ++stamps;
+    extent_protocol::attr a;
+    switch (o.code) {
+    case extent_protocol::create:
+      drop_pages(res.id, 0);
+      file->type = o.type;
+      file->dirty = false;
+      a.type = o.type;
+      a.size = 0;
+      a.atime = time(NULL);
+      a.ctime = time(NULL);
+      a.mtime = time(NULL);
+      set_attr(file, a);
+      break;
+    case extent_protocol::get:
+      drop_pages(res.id, 0);
+      set_attr(file, res.attr);
+      fill_pages(res.id, file, 0, npages(res.attr.size), res.buf);
+      break;
+    case extent_protocol::getattr:
+      if (file->attr_valid && file->attr.size != res.attr.size)
+        drop_pages(res.id, 0);
+      set_attr(file, res.attr);
+      break;
+    case extent_protocol::put:
+      drop_pages(res.id, 0);
+      if (!file->attr_valid) {
+        drop_file(res.id);
+        break;
+      }
+      a = file->attr;
+      a.size = o.buf.size();
+      a.ctime = time(NULL);
+      a.mtime = time(NULL);
+      set_attr(file, a);
+      fill_pages(res.id, file, 0, npages(a.size), o.buf);
+      break;
+    }
+  }
+  evict();
+  return ret;
+}
+
+extent_protocol::status
+extent_client::remove(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  // Your lab2 part1 code goes here
+  ScopedLock ml(&cache_mutex);
+  settle_file(eid);
+  drop_file(eid);
   int r;
   ret = cl->call(extent_protocol::remove, eid, r);
   return ret;
@@ -135,16 +952,13 @@ extent_client::remove(extent_protocol::extentid_t eid)
 extent_protocol::status 
 extent_client::sync(extent_protocol::extentid_t eid) {
   extent_protocol::status ret = extent_protocol::OK;
-  cached_file_p file = cache[eid];
+  ScopedLock ml(&cache_mutex);
+  cached_file_p file = settle_file(eid);
   if (file == NULL) {
     return ret;
   }
-  file->buf_valid = false;
-  file->attr_valid = false;
-  if (file->dirty) {
-    int r;
-    ret = cl->call(extent_protocol::put, eid, file->buf,r);
-    file->dirty = false;
-  }
+  ret = writeback(eid, file);
+  // the lock goes back, and with it the right to cache the file
+  drop_file(eid);
   return ret;
-}
\ No newline at end of file
+}
@@ -4,30 +4,170 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include <time.h>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// Default byte budget of the cache; EXTENT_CACHE_KB overrides it.
+#define EXTENT_CACHE_BYTES (8 << 20)
+// Bytes per page of the cache
+#define EXTENT_PAGE 4096
+// The flusher writes back a file dirty for this many seconds
+// (EXTENT_DIRTY_EXPIRE) and, oldest first, files while more dirty
+// bytes than this are cached (EXTENT_DIRTY_BACKGROUND_KB).
+#define EXTENT_DIRTY_EXPIRE 5
+#define EXTENT_DIRTY_BACKGROUND_BYTES (1 << 20)
+// Largest readahead window; EXTENT_READAHEAD_KB overrides it and 0
+// turns readahead off.
+#define EXTENT_READAHEAD_BYTES (1 << 20)
+// EXTENT_CACHE_STATS prints the cache counters every that many
+// seconds; unset or 0, they are only read through stats().
+
 class extent_client {
  private:
   rpcc *cl;
 
+  // File data is cached a page at a time, keyed by (file id, page
+  // index). A page past the end of file holds zeros from there on.
+  struct cached_page {
+    std::string data;
+    bool dirty;
+    bool referenced;  // used since the clock hand last passed
+    cached_page() : data(EXTENT_PAGE, '\0'), dirty(false), referenced(true) {}
+  };
+  typedef cached_page* cached_page_p;
+  typedef std::pair<extent_protocol::extentid_t, uint32_t> page_key;
+  // A file the cache knows of. Its pages are only cached with attr
+  // valid. A dirty file has dirty pages or a size the server has yet
+  // to see. server_size is the size the server last saw and trunc_to
+  // the least size the file was cut to since; bytes from trunc_to on
+  // are stale at the server.
   struct cached_file {
     uint32_t type;
-    std::string buf;
     extent_protocol::attr attr;
-    bool buf_valid;
     bool attr_valid;
     bool dirty;
+    time_t dirtied;  // when it last went dirty
+    unsigned int server_size;
+    unsigned int trunc_to;
+    // changes whenever the server's copy may have moved on from what
+    // a readahead in flight read
+    uint64_t stamp;
+    // Readahead: where a sequential read would go next, the window
+    // and how far it was read ahead. ra_pending readaheads are queued
+    // or in flight, covering [ra_start, ra_end) at most.
+    unsigned int ra_next;
+    unsigned int ra_window;
+    unsigned int ra_start, ra_end;
+    unsigned int ra_pending;
+    // The flusher is sending it without cache_mutex held; cut_to is the
+    // least size it was cut to meanwhile.
+    bool flushing;
+    unsigned int cut_to;
     cached_file() {
-      buf_valid = false;
       attr_valid = false;
       dirty = false;
+      dirtied = 0;
+      server_size = trunc_to = 0;
+      stamp = 0;
+      ra_next = ra_window = 0;
+      ra_start = ra_end = 0;
+      ra_pending = 0;
+      flushing = false;
+      cut_to = 0;
     }
   };
-  typedef cached_file* cached_file_p; 
+  typedef cached_file* cached_file_p;
+  // The pages are bounded by a byte budget and evicted in CLOCK
+  // order, the hand sweeping the page map. A dirty page has its file
+  // written back first. File entries go at sync and remove.
+  // cache_mutex guards it all, across the RPCs of foreground calls
+  // too, since lock revocations sync files from another thread.
   std::map<extent_protocol::extentid_t, cached_file_p> cache;
+  std::map<page_key, cached_page_p> pages;
+  pthread_mutex_t cache_mutex;
+  size_t budget;
+  size_t cache_bytes;
+  page_key hand;
+  // Dirty data is written back in the background by the flusher
+  // thread, woken by flush_cond when too much of it piles up. It
+  // sends a file without cache_mutex held; flush_done wakes calls
+  // that wait for it to finish with a file.
+  pthread_cond_t flush_cond;
+  pthread_cond_t flush_done;
+  time_t dirty_expire;
+  size_t dirty_background;
+  size_t dirty_bytes;
+  // Readaheads wait in ra_queue for the readahead thread, which reads
+  // without holding cache_mutex. ra_done wakes reads that wait for
+  // pages a readahead is after.
+  struct readahead {
+    extent_protocol::extentid_t eid;
+    unsigned int off, len;
+    uint64_t stamp;
+  };
+  std::deque<readahead> ra_queue;
+  pthread_cond_t ra_cond;
+  pthread_cond_t ra_done;
+  size_t readahead_max;
+  uint64_t stamps;
+  // cache counters, and how often the flusher prints them
+  uint64_t hits, misses, evictions, writebacks, readaheads;
+  time_t stats_interval;
+  time_t stats_due;
+  void print_stats();
+  cached_file_p find_file(extent_protocol::extentid_t eid);
+  cached_file_p insert_file(extent_protocol::extentid_t eid);
+  void drop_file(extent_protocol::extentid_t eid);
+  cached_page_p find_page(extent_protocol::extentid_t eid, uint32_t index);
+  cached_page_p insert_page(extent_protocol::extentid_t eid, uint32_t index);
+  void drop_pages(extent_protocol::extentid_t eid, uint32_t from);
+  void dirty_file(cached_file_p file);
+  void dirty_page(cached_file_p file, cached_page_p page);
+  bool have_range(extent_protocol::extentid_t eid, unsigned int off, unsigned int len);
+  void copy_range(extent_protocol::extentid_t eid, unsigned int off, unsigned int len, std::string &buf);
+  void fill_pages(extent_protocol::extentid_t eid, cached_file_p file,
+                  uint32_t from, uint32_t to, const std::string &buf);
+  void set_attr(cached_file_p file, const extent_protocol::attr &a);
+  extent_protocol::status fetch_attr(extent_protocol::extentid_t eid, cached_file_p &file);
+  extent_protocol::status fetch_range(extent_protocol::extentid_t eid, cached_file_p file,
+                                      unsigned int off, unsigned int len);
+  // A copy of the changes a writeback sends: the whole file, or a cut
+  // to trunc_to, runs of pages and the final size. cleaned lists the
+  // pages it marked clean, dirtied again if it fails.
+  struct writeback_job {
+    bool whole;
+    std::string buf;
+    unsigned int server_size, trunc_to, size;
+    std::vector<std::pair<unsigned int, std::string> > runs;
+    std::vector<uint32_t> cleaned;
+  };
+  void begin_writeback(extent_protocol::extentid_t eid, cached_file_p file,
+                       writeback_job &job);
+  extent_protocol::status send_writeback(extent_protocol::extentid_t eid,
+                                         const writeback_job &job);
+  void end_writeback(extent_protocol::extentid_t eid, cached_file_p file,
+                     const writeback_job &job, extent_protocol::status ret);
+  extent_protocol::status writeback(extent_protocol::extentid_t eid, cached_file_p file);
+  cached_file_p settle_file(extent_protocol::extentid_t eid);
+  void evict();
+  void flusher();
+  void read_ahead(extent_protocol::extentid_t eid, cached_file_p file,
+                  unsigned int off, unsigned int len);
+  void reader();
+  void ra_fill(const readahead &r);
  public:
+  struct cache_stats {
+    uint64_t hits, misses, evictions, writebacks, readaheads;
+  };
+
   extent_client(std::string dst);
+  void set_cache_budget(size_t bytes);
+  size_t cached_bytes();
+  cache_stats stats();
 
   extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
@@ -35,6 +175,15 @@ class extent_client {
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     unsigned int off, unsigned int len,
+                                     std::string &buf);
+  extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                      unsigned int off, std::string buf);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   unsigned int size);
+  extent_protocol::status compound(std::vector<extent_protocol::op> &ops,
+                                   std::vector<extent_protocol::result> &results);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
   extent_protocol::status sync(extent_protocol::extentid_t eid);
 };
@@ -15,7 +15,11 @@ class extent_protocol {
     get,
     getattr,
     remove,
-    create
+    create,
+    read_range,
+    write_range,
+    compound,
+    truncate
   };
 
   enum types {
@@ -35,6 +39,24 @@ class extent_protocol {
     extent_protocol::attr attr;
     std::string buf;
   };
+  // One step of a compound call. code is the rpc number of a create,
+  // get, getattr, put or remove; type is the file type of a create
+  // and buf the data of a put. An id of 0 names the file made by the
+  // latest create earlier in the same call.
+  struct op {
+    int code;
+    extentid_t id;
+    uint32_t type;
+    std::string buf;
+  };
+  // What a step of a compound call returned: the id of a create, the
+  // attributes of a get or getattr and the data of a get.
+  struct result {
+    status ret;
+    extentid_t id;
+    extent_protocol::attr attr;
+    std::string buf;
+  };
 };
 
 inline unmarshall &
@@ -49,7 +71,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
 }
 
 inline marshall &
-operator<<(marshall &m, extent_protocol::attr a)
+operator<<(marshall &m, const extent_protocol::attr &a)
 {
   m << a.type;
   m << a.atime;
@@ -72,7 +94,7 @@ operator>>(unmarshall &u, extent_protocol::full_file &f)
 }
 
 inline marshall &
-operator<<(marshall &m, extent_protocol::full_file f)
+operator<<(marshall &m, const extent_protocol::full_file &f)
 {
   m << f.attr.type;
   m << f.attr.atime;
@@ -83,4 +105,44 @@ operator<<(marshall &m, extent_protocol::full_file f)
   return m;
 }
 
-#endif 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::op &o)
+{
+  u >> o.code;
+  u >> o.id;
+  u >> o.type;
+  u >> o.buf;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::op &o)
+{
+  m << o.code;
+  m << o.id;
+  m << o.type;
+  m << o.buf;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::result &r)
+{
+  u >> r.ret;
+  u >> r.id;
+  u >> r.attr;
+  u >> r.buf;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::result &r)
+{
+  m << r.ret;
+  m << r.id;
+  m << r.attr;
+  m << r.buf;
+  return m;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "inode_manager.h"
+// Verify the checksums of every block in use on a disk image
+
+int
+main(int argc, char *argv[])
+{
+  char buf[BLOCK_SIZE];
+  uint64_t *words = (uint64_t *) buf;
+  struct superblock sb;
+  int fd;
+
+  if(argc != 2){
+    fprintf(stderr, "Usage: %s disk-image\n", argv[0]);
+    exit(1);
+  }
+
+  // only scrub an image of this layout; never format, grow or write it
+  fd = open(argv[1], O_RDONLY);
+  if(fd < 0){
+    fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[1]);
+    exit(1);
+  }
+  if(pread(fd, buf, BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE){
+    fprintf(stderr, "%s: %s has no superblock\n", argv[0], argv[1]);
+    exit(1);
+  }
+  close(fd);
+  memcpy(&sb, buf, sizeof(sb));
+  if(sb.magic != SB_MAGIC || sb.nblocks != BLOCK_NUM || sb.ninodes != INODE_NUM){
+    fprintf(stderr, "%s: %s is not a yfs image of this layout\n", argv[0], argv[1]);
+    exit(1);
+  }
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  disk d(argv[1], disk::CHECKSUM | disk::READONLY);
+  if(!d.csums_valid){
+    fprintf(stderr, "%s: %s was last mounted without checksums; its checksums are stale\n",
+            argv[0], argv[1]);
+    exit(1);
+  }
+  // every block in use, as the block bitmap has it, metadata included
+  uint32_t bad = 0;
+  for(blockid_t id = 0; id < sb.nblocks; id++){
+    if(id % BPB == 0)
+      d.read_block(BBLOCK(id), buf);
+    if(((words[(id % BPB) / 64] >> (id % 64)) & 1) && !d.verify_block(id))
+      bad++;
+  }
+  printf("%s: %u bad block(s)\n", argv[1], bad);
+  return bad ? 2 : 0;
+}
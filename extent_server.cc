@@ -9,12 +9,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-extent_server::extent_server() 
+extent_server::extent_server(const char *image, int sync_mode)
 {
-  im = new inode_manager();
+  im = new inode_manager(image, sync_mode);
 }
 
-int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
+int extent_server::do_create(uint32_t type, extent_protocol::extentid_t &id)
 {
   // alloc a new inode and return inum
   id = im->alloc_inode(type);
@@ -23,7 +23,14 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
+{
+  int ret = do_create(type, id);
+  im->sync();
+  return ret;
+}
+
+int extent_server::do_put(extent_protocol::extentid_t id, std::string buf)
 {
   printf("extent_server: put %lld\n", id);
   id &= 0x7fffffff;
@@ -35,62 +42,158 @@ int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
   return extent_protocol::OK;
 }
 
+int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+{
+  int ret = do_put(id, buf);
+  im->sync();
+  return ret;
+}
+
 int extent_server::get(extent_protocol::extentid_t id, extent_protocol::full_file& file)
 {
   printf("extent_server: get %lld\n", id);
 
   id &= 0x7fffffff;
 
-  int size = 0;
-  char *cbuf = NULL;
-
-  im->read_file(id, &cbuf, &size);
-  if (size == 0)
-    file.buf = "";
-  else {
-    file.buf.assign(cbuf, size);
-    free(cbuf);
-  }
-
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
   im->getattr(id, attr);
   file.attr = attr;
 
+  // read straight into the reply; the file may shrink in between
+  file.buf.resize(attr.size);
+  if (attr.size > 0)
+    file.buf.resize(im->read_at(id, 0, attr.size, &file.buf[0]));
+  file.attr.size = file.buf.size();
+
   return extent_protocol::OK;
 }
 
-int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::full_file &file)
+int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
   printf("extent_server: getattr %lld\n", id);
 
   id &= 0x7fffffff;
   
+  // metadata only; the data goes over get and read_range
+  memset(&a, 0, sizeof(a));
+  im->getattr(id, a);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::do_remove(extent_protocol::extentid_t id)
+{
+  printf("extent_server: remove %lld\n", id);
+
+  id &= 0x7fffffff;
+  im->remove_file(id);
+ 
+  return extent_protocol::OK;
+}
+
+int extent_server::remove(extent_protocol::extentid_t id, int &)
+{
+  int ret = do_remove(id);
+  im->sync();
+  return ret;
+}
+
+
+int extent_server::read_range(extent_protocol::extentid_t id, unsigned int off,
+                              unsigned int len, std::string &buf)
+{
+  printf("extent_server: read_range %lld off %u len %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+
+  // size the reply exactly, then read straight into it
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
   im->getattr(id, attr);
-  file.attr = attr;
+  if (off >= attr.size)
+    len = 0;
+  else if (len > attr.size - off)
+    len = attr.size - off;
+  buf.resize(len);
+  if (len > 0)
+    buf.resize(im->read_at(id, off, len, &buf[0]));
 
-  int size = 0;
-  char *cbuf = NULL;
-  im->read_file(id, &cbuf, &size);
-  if (size == 0)
-    file.buf = "";
-  else {
-    file.buf.assign(cbuf, size);
-    free(cbuf);
-  }
+  return extent_protocol::OK;
+}
+
+int extent_server::write_range(extent_protocol::extentid_t id, unsigned int off,
+                               std::string buf, int &)
+{
+  printf("extent_server: write_range %lld off %u len %zu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+  im->write_range(id, off, buf.data(), buf.size());
+  im->sync();
 
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+// Cut or extend the file to size bytes in place, without its data
+// going over the wire.
+int extent_server::truncate(extent_protocol::extentid_t id, unsigned int size, int &)
 {
-  printf("extent_server: remove %lld\n", id);
+  printf("extent_server: truncate %lld size %u\n", id, size);
 
   id &= 0x7fffffff;
-  im->remove_file(id);
- 
+  im->truncate(id, size);
+  im->sync();
+
   return extent_protocol::OK;
 }
 
+// Run the steps of ops in order and return one result per step.
+// Every step runs, even after one fails, and the changes of all of
+// them commit together at the end.
+int extent_server::compound(std::vector<extent_protocol::op> ops,
+                            std::vector<extent_protocol::result> &results)
+{
+  printf("extent_server: compound of %zu\n", ops.size());
+
+  extent_protocol::extentid_t last = 0;
+  bool changed = false;
+  results.resize(ops.size());
+  for (size_t i = 0; i < ops.size(); i++) {
+    extent_protocol::op &o = ops[i];
+    extent_protocol::result &res = results[i];
+    extent_protocol::extentid_t id = o.id ? o.id : last;
+    res.id = id;
+    memset(&res.attr, 0, sizeof(res.attr));
+    switch (o.code) {
+    case extent_protocol::create:
+      res.ret = do_create(o.type, res.id);
+      last = res.id;
+      changed = true;
+      break;
+    case extent_protocol::get: {
+      extent_protocol::full_file file;
+      res.ret = get(id, file);
+      res.attr = file.attr;
+      res.buf.swap(file.buf);
+      break;
+    }
+    case extent_protocol::getattr:
+      res.ret = getattr(id, res.attr);
+      break;
+    case extent_protocol::put:
+      res.ret = do_put(id, o.buf);
+      changed = true;
+      break;
+    case extent_protocol::remove:
+      res.ret = do_remove(id);
+      changed = true;
+      break;
+    default:
+      res.ret = extent_protocol::IOERR;
+    }
+  }
+  if (changed)
+    im->sync();
+
+  return extent_protocol::OK;
+}
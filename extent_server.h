@@ -5,6 +5,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
@@ -18,15 +19,28 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // The work of the mutating RPCs, without the commit that ends each;
+  // a compound call commits its steps once.
+  int do_create(uint32_t type, extent_protocol::extentid_t &id);
+  int do_put(extent_protocol::extentid_t id, std::string);
+  int do_remove(extent_protocol::extentid_t id);
 
  public:
-  extent_server();
+  extent_server(const char *image = NULL, int sync_mode = disk::SYNC_NONE);
+  void set_commit_window(uint32_t usec, uint32_t bytes) { im->set_commit_window(usec, bytes); }
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
   int put(extent_protocol::extentid_t id, std::string, int &);
   int get(extent_protocol::extentid_t id, extent_protocol::full_file &);
-  int getattr(extent_protocol::extentid_t id, extent_protocol::full_file &);
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int read_range(extent_protocol::extentid_t id, unsigned int off,
+                 unsigned int len, std::string &);
+  int write_range(extent_protocol::extentid_t id, unsigned int off,
+                  std::string, int &);
+  int compound(std::vector<extent_protocol::op>,
+               std::vector<extent_protocol::result> &);
+  int truncate(extent_protocol::extentid_t id, unsigned int size, int &);
 };
 
 #endif 
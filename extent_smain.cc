@@ -4,17 +4,23 @@
 #include <stdio.h>
 #include "extent_server.h"
 #include <unistd.h>
+#include <string.h>
 // Main loop of extent server
 
 int
 main(int argc, char *argv[])
 {
   int count = 0;
+  int sync_mode = disk::SYNC_NONE;
+  const char *image = NULL;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s port [disk-image]\n", argv[0]);
     exit(1);
   }
+  if(argc == 3){
+    image = argv[2];
+  }
 
   setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -23,14 +29,53 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  // DISK_SYNC=none|async|full picks how hard each update is pushed
+  // to the disk image; it has no effect without an image.
+  char *sync_env = getenv("DISK_SYNC");
+  if(sync_env != NULL){
+    if(strcmp(sync_env, "async") == 0)
+      sync_mode = disk::SYNC_ASYNC;
+    else if(strcmp(sync_env, "full") == 0)
+      sync_mode = disk::SYNC_FULL;
+  }
+
+  // DISK_CSUM=on keeps a checksum per block and verifies it on read
+  char *csum_env = getenv("DISK_CSUM");
+  if(csum_env != NULL && strcmp(csum_env, "on") == 0)
+    sync_mode |= disk::CHECKSUM;
+
+  // DISK_COMPRESS=on stores file data compressed where that saves blocks
+  char *compress_env = getenv("DISK_COMPRESS");
+  if(compress_env != NULL && strcmp(compress_env, "on") == 0)
+    sync_mode |= disk::COMPRESS;
+
+  // DISK_DEDUP=on stores blocks of identical content once
+  char *dedup_env = getenv("DISK_DEDUP");
+  if(dedup_env != NULL && strcmp(dedup_env, "on") == 0)
+    sync_mode |= disk::DEDUP;
+
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(image, sync_mode);
+
+  // With DISK_SYNC=full, COMMIT_WINDOW_US and COMMIT_WINDOW_KB let a
+  // commit wait that long, or for that much written, so that
+  // concurrent puts share one flush.
+  char *window_env = getenv("COMMIT_WINDOW_US");
+  char *window_kb_env = getenv("COMMIT_WINDOW_KB");
+  if(window_env != NULL || window_kb_env != NULL){
+    ls.set_commit_window(window_env ? atoi(window_env) : 0,
+                         window_kb_env ? atoi(window_kb_env) * 1024 : 0);
+  }
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
   server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::compound, &ls, &extent_server::compound);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
 
   while(1)
     sleep(1000);
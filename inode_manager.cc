@@ -1,10 +1,136 @@
 #include "inode_manager.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "slock.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
 
 // disk layer -----------------------------------------
 
-disk::disk()
+#define MAP_LEN ((size_t) (BLOCK_NUM + 1 + NCSUM) * BLOCK_SIZE)
+
+// An in-memory disk, lost when the process exits.
+disk::disk(int mode)
+{
+  fd = -1;
+  sync_mode = SYNC_NONE;
+  checksum = mode & CHECKSUM;
+  dirty_lo = BLOCK_NUM + 1 + NCSUM;
+  dirty_hi = 0;
+  pthread_mutex_init(&dirty_mutex, NULL);
+  void *p = mmap(NULL, MAP_LEN, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("\tdisk: error! mmap failed.\n");
+    exit(1);
+  }
+  blocks = (unsigned char (*)[BLOCK_SIZE]) p;
+  init_csums();
+}
+
+// A disk backed by a (sparse) image file, mapped shared so the
+// blocks survive a restart. A read-only disk needs the image in full
+// and never writes it.
+disk::disk(const char *image, int mode)
+{
+  struct stat st;
+  off_t len = (off_t) MAP_LEN;
+  bool readonly = mode & READONLY;
+
+  sync_mode = mode & SYNC_MASK;
+  checksum = mode & CHECKSUM;
+  dirty_lo = BLOCK_NUM + 1 + NCSUM;
+  dirty_hi = 0;
+  pthread_mutex_init(&dirty_mutex, NULL);
+  fd = readonly ? open(image, O_RDONLY) : open(image, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("\tdisk: error! cannot open image %s.\n", image);
+    exit(1);
+  }
+  if (st.st_size < len && readonly) {
+    printf("\tdisk: error! image %s is too small.\n", image);
+    exit(1);
+  }
+  if (st.st_size < len && ftruncate(fd, len) != 0) {
+    printf("\tdisk: error! cannot grow image %s.\n", image);
+    exit(1);
+  }
+  int prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+  void *p = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    printf("\tdisk: error! mmap of %s failed.\n", image);
+    exit(1);
+  }
+  blocks = (unsigned char (*)[BLOCK_SIZE]) p;
+  init_csums(readonly);
+}
+
+// The header says whether the table is up to date. Mounting without
+// checksums invalidates it, since writes stop updating it; mounting
+// with them recomputes a stale table from the blocks as they are.
+// A read-only mount changes neither.
+void
+disk::init_csums(bool readonly)
+{
+  csum_header = (uint32_t *) blocks[BLOCK_NUM];
+  csums = (uint32_t *) blocks[BLOCK_NUM + 1];
+  bad_reads = 0;
+  bool valid = csum_header[0] == CSUM_MAGIC;
+  csums_valid = valid;
+  if (readonly)
+    return;
+  if (!checksum) {
+    if (valid) {
+      csum_header[0] = 0;
+      mark_dirty(BLOCK_NUM, BLOCK_NUM + 1);
+    }
+    csums_valid = false;
+    return;
+  }
+  if (valid)
+    return;
+  for (blockid_t id = 0; id < BLOCK_NUM; id++)
+    csums[id] = crc32c(0, blocks[id], BLOCK_SIZE);
+  csum_header[0] = CSUM_MAGIC;
+  mark_dirty(BLOCK_NUM, BLOCK_NUM + 1 + NCSUM);
+  csums_valid = true;
+}
+
+disk::~disk()
+{
+  if (fd >= 0) {
+    msync(blocks, MAP_LEN, MS_SYNC);
+    close(fd);
+  }
+  munmap(blocks, MAP_LEN);
+}
+
+// Widen the range of blocks to flush by the next sync.
+void
+disk::mark_dirty(blockid_t lo, blockid_t hi)
+{
+  ScopedLock ml(&dirty_mutex);
+  if (lo < dirty_lo)
+    dirty_lo = lo;
+  if (hi > dirty_hi)
+    dirty_hi = hi;
+}
+
+// Check block id against its checksum; a mismatch is reported and
+// counted, and the data returned as is.
+bool
+disk::verify_block(uint32_t id)
 {
-  bzero(blocks, sizeof(blocks));
+  if (!checksum || id >= BLOCK_NUM)
+    return true;
+  if (crc32c(0, blocks[id], BLOCK_SIZE) == csums[id])
+    return true;
+  printf("\tdisk: error! checksum mismatch on block %u.\n", id);
+  __atomic_add_fetch(&bad_reads, 1, __ATOMIC_RELAXED);
+  return false;
 }
 
 void
@@ -13,6 +139,7 @@ disk::read_block(blockid_t id, char *buf)
   if (id < 0 || id >= BLOCK_NUM || buf == NULL)
     return;
 
+  verify_block(id);
   memcpy(buf, blocks[id], BLOCK_SIZE);
 }
 
@@ -23,43 +150,477 @@ disk::write_block(blockid_t id, const char *buf)
     return;
 
   memcpy(blocks[id], buf, BLOCK_SIZE);
+  if (checksum) {
+    csums[id] = crc32c(0, buf, BLOCK_SIZE);
+    blockid_t cb = BLOCK_NUM + 1 + id * sizeof(uint32_t) / BLOCK_SIZE;
+    mark_dirty(cb, cb + 1);
+  }
+  mark_dirty(id, id + 1);
+}
+
+// Copy n consecutive blocks starting at id into buf in one go.
+void
+disk::read_blocks(blockid_t id, uint32_t n, char *buf)
+{
+  if (id >= BLOCK_NUM || n > BLOCK_NUM - id || buf == NULL)
+    return;
+
+  if (checksum) {
+    for (uint32_t i = 0; i < n; i++)
+      verify_block(id + i);
+  }
+  memcpy(buf, blocks[id], (size_t) n * BLOCK_SIZE);
+}
+
+void
+disk::write_blocks(blockid_t id, uint32_t n, const char *buf)
+{
+  if (id >= BLOCK_NUM || n > BLOCK_NUM - id || buf == NULL || n == 0)
+    return;
+
+  memcpy(blocks[id], buf, (size_t) n * BLOCK_SIZE);
+  if (checksum) {
+    for (uint32_t i = 0; i < n; i++)
+      csums[id + i] = crc32c(0, buf + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+    mark_dirty(BLOCK_NUM + 1 + id * sizeof(uint32_t) / BLOCK_SIZE,
+               BLOCK_NUM + 2 + (id + n - 1) * sizeof(uint32_t) / BLOCK_SIZE);
+  }
+  mark_dirty(id, id + n);
+}
+
+// Flush the blocks written since the last sync to the image file,
+// according to the sync mode.
+void
+disk::sync()
+{
+  ScopedLock ml(&dirty_mutex);
+  if (fd < 0 || sync_mode == SYNC_NONE || dirty_lo >= dirty_hi)
+    return;
+
+  long pagesize = sysconf(_SC_PAGESIZE);
+  uintptr_t lo = (uintptr_t) blocks[dirty_lo] & ~(uintptr_t) (pagesize - 1);
+  uintptr_t hi = (uintptr_t) blocks[dirty_hi - 1] + BLOCK_SIZE;
+  if (sync_mode == SYNC_ASYNC) {
+    msync((void *) lo, hi - lo, MS_ASYNC);
+  } else {
+    msync((void *) lo, hi - lo, MS_SYNC);
+    fdatasync(fd);
+  }
+  dirty_lo = BLOCK_NUM + 1 + NCSUM;
+  dirty_hi = 0;
 }
 
 // block layer -----------------------------------------
 
+// The lock guarding the read-modify-writes of bitmap block bmblock.
+pthread_mutex_t *
+block_manager::bitmap_lock(blockid_t bmblock)
+{
+    return &bitmap_locks[bmblock - BBLOCK(0)];
+}
+
+// The next-fit hint of the calling thread's allocator shard. Hints
+// are only advisory, so they are read and set without a lock.
+blockid_t &
+block_manager::shard_hint()
+{
+    uintptr_t self = (uintptr_t) pthread_self();
+    return alloc_hint[(self ^ (self >> 12)) % NSHARD];
+}
+
+// Find and set a clear bit in the nbits-bit bitmap stored from block
+// start on. Scan a word at a time from the next-fit hint, wrapping
+// around once. Bit 0 is always reserved, so 0 means the bitmap is full.
+uint32_t
+block_manager::alloc_bit(blockid_t start, uint32_t nbits, uint32_t &hint)
+{
+    char buf[BLOCK_SIZE];
+    uint64_t *words = (uint64_t *) buf;
+    uint32_t nbitmap = (nbits + BPB - 1) / BPB;
+    uint32_t h = __atomic_load_n(&hint, __ATOMIC_RELAXED) % nbits;
+    uint32_t bmap = h / BPB;
+    uint32_t w = (h % BPB) / 64;
+    for (uint32_t n = 0; n <= nbitmap; n++) {
+        ScopedLock ml(bitmap_lock(start + bmap));
+        read_meta_block(start + bmap, buf);
+        for (; w < WPB; w++) {
+            uint64_t avail = ~words[w];
+            if (avail != 0 && start == BBLOCK(0)) {
+                avail &= ~reserved_bits(bmap * BPB + w * 64);
+            }
+            if (avail == 0) {
+                continue;
+            }
+            uint32_t bit = __builtin_ctzll(avail);
+            words[w] |= (uint64_t) 1 << bit;
+            write_meta_block(start + bmap, buf);
+            bit += bmap * BPB + w * 64;
+            __atomic_store_n(&hint, (bit + 1) % nbits, __ATOMIC_RELAXED);
+            return bit;
+        }
+        w = 0;
+        bmap = (bmap + 1) % nbitmap;
+    }
+    return 0;
+}
+
+void
+block_manager::free_bit(blockid_t start, uint32_t bit)
+{
+    char buf[BLOCK_SIZE];
+    uint64_t *words = (uint64_t *) buf;
+    ScopedLock ml(bitmap_lock(start + bit / BPB));
+    read_meta_block(start + bit / BPB, buf);
+    words[(bit % BPB) / 64] &= ~((uint64_t) 1 << (bit % 64));
+    write_meta_block(start + bit / BPB, buf);
+}
+
+// Clear the nbits-bit bitmap stored from block start on, except for
+// the first nreserved bits and the padding past nbits.
+void
+block_manager::init_bitmap(blockid_t start, uint32_t nbits, uint32_t nreserved)
+{
+  char buf[BLOCK_SIZE];
+  uint64_t *words = (uint64_t *) buf;
+  uint32_t nbitmap = (nbits + BPB - 1) / BPB;
+  for (uint32_t bmap = 0; bmap < nbitmap; bmap++) {
+    bzero(buf, sizeof(buf));
+    for (uint32_t bit = 0; bit < BPB; bit++) {
+      uint32_t id = bmap * BPB + bit;
+      if (id < nreserved || id >= nbits)
+        words[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+    write_meta_block(start + bmap, buf);
+  }
+}
+
 // Allocate a free disk block.
 blockid_t
 block_manager::alloc_block()
 {
-    blockid_t start_at = IBLOCK(INODE_NUM, BLOCK_NUM) + 1;
-    for (blockid_t i = start_at; i < BLOCK_NUM; i++) {
-        int is_used = using_blocks[i];
-        if (is_used == 0) {
-            using_blocks[i] = 1;
-            return i;
-        }
+    blockid_t id = alloc_bit(BBLOCK(0), sb.nblocks, shard_hint());
+    if (id == 0) {
+        printf("\tbm:error! no more free block to alloc.\n");
+        exit(0);
     }
-    printf("\tbm:error! no more free block to alloc.\n");
-    exit(0);
+    return id;
 }
 
 void
 block_manager::free_block(uint32_t id)
 {
-    using_blocks[id] = 0;
+    free_run(id, 1);
+}
+
+// Allocate a run of up to want contiguous blocks, starting at goal
+// if that block is free, or else at the first free block after the
+// next-fit hint. Return the first block and set *got to the run length.
+blockid_t
+block_manager::alloc_run(blockid_t goal, uint32_t want, uint32_t *got)
+{
+    char buf[BLOCK_SIZE];
+    uint64_t *words = (uint64_t *) buf;
+    blockid_t start = 0;
+    uint32_t len = 0;
+    if (goal != 0 && goal < sb.nblocks) {
+        ScopedLock ml(bitmap_lock(BBLOCK(goal)));
+        read_meta_block(BBLOCK(goal), buf);
+        uint64_t *word = &words[(goal % BPB) / 64];
+        uint64_t used = *word | reserved_bits(goal - goal % 64);
+        if (!((used >> (goal % 64)) & 1)) {
+            *word |= (uint64_t) 1 << (goal % 64);
+            write_meta_block(BBLOCK(goal), buf);
+            start = goal;
+            len = 1;
+        }
+    }
+    if (len == 0) {
+        start = alloc_block();
+        len = 1;
+    }
+    // grow the run a word at a time until a used block stops it,
+    // holding the lock of one bitmap block at a time
+    while (len < want && start + len < sb.nblocks) {
+        blockid_t bmblock = BBLOCK(start + len);
+        ScopedLock ml(bitmap_lock(bmblock));
+        read_meta_block(bmblock, buf);
+        bool stopped = false;
+        while (len < want && start + len < sb.nblocks && BBLOCK(start + len) == bmblock) {
+            blockid_t id = start + len;
+            uint32_t w = (id % BPB) / 64;
+            uint32_t bit = id % 64;
+            uint64_t used = (words[w] | reserved_bits(id - bit)) >> bit;
+            uint32_t avail = used ? __builtin_ctzll(used) : 64 - bit;
+            uint32_t n = avail;
+            if (n > want - len) {
+                n = want - len;
+            }
+            if (n == 0) {
+                stopped = true;
+                break;
+            }
+            words[w] |= (n == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << n) - 1)) << bit;
+            len += n;
+            if (n == avail && used) {
+                stopped = true;
+                break;
+            }
+        }
+        write_meta_block(bmblock, buf);
+        if (stopped) {
+            break;
+        }
+    }
+    __atomic_store_n(&shard_hint(), (start + len) % sb.nblocks, __ATOMIC_RELAXED);
+    *got = len;
+    return start;
+}
+
+// Free n contiguous blocks starting at start. A block other files
+// still map only loses a reference.
+void
+block_manager::free_run(blockid_t start, uint32_t n)
+{
+    if (start >= sb.nblocks || n > sb.nblocks - start) {
+        return;
+    }
+    while (n > 0) {
+        uint32_t k = 0;
+        {
+            ScopedLock rl(&ref_mutex);
+            if (refs[start] > 0) {
+                if (--refs[start] == 0) {
+                    nshared--;
+                }
+                write_refs(start);
+                start++;
+                n--;
+                continue;
+            }
+            for (; k < n && refs[start + k] == 0; k++) {
+                drop_fingerprint(start + k);
+            }
+        }
+        clear_run(start, k);
+        start += k;
+        n -= k;
+    }
+}
+
+// Clear the bits of n contiguous blocks starting at start, one
+// bitmap read-modify-write per bitmap block.
+void
+block_manager::clear_run(blockid_t start, uint32_t n)
+{
+    char buf[BLOCK_SIZE];
+    uint64_t *words = (uint64_t *) buf;
+    while (n > 0) {
+        uint32_t bmap = start / BPB;
+        ScopedLock ml(bitmap_lock(BBLOCK(start)));
+        read_meta_block(BBLOCK(start), buf);
+        blockid_t first = start;
+        for (; n > 0 && start / BPB == bmap; start++, n--) {
+            words[(start % BPB) / 64] &= ~((uint64_t) 1 << (start % 64));
+        }
+        write_meta_block(BBLOCK(bmap * BPB), buf);
+        // under the bitmap lock, so no allocation sees the bits clear
+        // before the blocks are held back
+        if (journaling) {
+            ScopedLock jl(&journal_mutex);
+            for (blockid_t b = first; b < start; b++) {
+                freed_running.insert(b);
+            }
+        }
+    }
+}
+
+// The blocks among base..base+63 freed by a transaction that has not
+// committed yet, as a mask.
+uint64_t
+block_manager::reserved_bits(blockid_t base)
+{
+    if (!journaling) {
+        return 0;
+    }
+    uint64_t mask = 0;
+    ScopedLock jl(&journal_mutex);
+    std::set<blockid_t> *freed[2] = { &freed_running, &freed_committing };
+    for (int i = 0; i < 2; i++) {
+        std::set<blockid_t>::iterator it = freed[i]->lower_bound(base);
+        for (; it != freed[i]->end() && *it < base + 64; ++it) {
+            mask |= (uint64_t) 1 << (*it - base);
+        }
+    }
+    return mask;
+}
+
+// Write back the block of the reference count table holding block
+// id's count. Called with ref_mutex held.
+void
+block_manager::write_refs(blockid_t id)
+{
+    write_meta_block(RBLOCK(sb.nblocks) + id / RPB, (const char *) &refs[id - id % RPB]);
+}
+
+// Take block id out of the fingerprint index. Called with ref_mutex
+// held.
+void
+block_manager::drop_fingerprint(blockid_t id)
+{
+    std::map<blockid_t, uint32_t>::iterator it = fingerprint_of.find(id);
+    if (it == fingerprint_of.end()) {
+        return;
+    }
+    std::multimap<uint32_t, blockid_t>::iterator f = fingerprints.lower_bound(it->second);
+    while (f != fingerprints.end() && f->first == it->second) {
+        if (f->second == id) {
+            fingerprints.erase(f);
+            break;
+        }
+        ++f;
+    }
+    fingerprint_of.erase(it);
+}
+
+// Return a block already holding the content of buf, with one more
+// reference taken on it, or 0 if there is none.
+blockid_t
+block_manager::find_dup(const char *buf)
+{
+    char block[BLOCK_SIZE];
+    if (!dedup) {
+        return 0;
+    }
+    uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+    ScopedLock rl(&ref_mutex);
+    std::multimap<uint32_t, blockid_t>::iterator f = fingerprints.lower_bound(crc);
+    for (; f != fingerprints.end() && f->first == crc; ++f) {
+        blockid_t id = f->second;
+        if (refs[id] == MAXREFS) {
+            continue;
+        }
+        // indexed blocks are not written to, so it is safe to compare
+        d->read_block(id, block);
+        if (memcmp(block, buf, BLOCK_SIZE) != 0) {
+            continue;
+        }
+        if (refs[id]++ == 0) {
+            nshared++;
+        }
+        write_refs(id);
+        return id;
+    }
+    return 0;
+}
+
+// Index block id, just written with the content of buf.
+void
+block_manager::add_fingerprint(blockid_t id, const char *buf)
+{
+    if (!dedup) {
+        return;
+    }
+    uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+    ScopedLock rl(&ref_mutex);
+    drop_fingerprint(id);
+    fingerprints.insert(std::make_pair(crc, id));
+    fingerprint_of[id] = crc;
+}
+
+// Get n contiguous blocks starting at id ready to be written in place.
+// Return false if one of them is shared, and must be copied instead;
+// otherwise they leave the fingerprint index.
+bool
+block_manager::own_blocks(blockid_t id, uint32_t n)
+{
+    ScopedLock rl(&ref_mutex);
+    if (nshared == 0 && fingerprint_of.empty()) {
+        return true;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (refs[id + i] > 0) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        drop_fingerprint(id + i);
+    }
+    return true;
 }
 
 // The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager()
+// |<-boot->|<-sb->|<-free block bitmap->|<-inode bitmap->|<-inode table->|<-journal->|<-refcounts->|<-data->|
+// An image that already carries a superblock is mounted as is, after
+// replaying its journal.
+block_manager::block_manager(const char *image, int sync_mode)
 {
-  d = new disk();
+  char buf[BLOCK_SIZE];
+  blockid_t data_start = RBLOCK(BLOCK_NUM) + NREFS;
+
+  if (image)
+    d = new disk(image, sync_mode);
+  else
+    d = new disk(sync_mode);
+  // spread the shards over the data blocks
+  for (int i = 0; i < NSHARD; i++)
+    alloc_hint[i] = data_start + (BLOCK_NUM - data_start) / NSHARD * i;
+  uint32_t nlocks = IBMBLOCK(INODE_NUM, BLOCK_NUM) + 1 - BBLOCK(0);
+  bitmap_locks = new pthread_mutex_t[nlocks];
+  for (uint32_t i = 0; i < nlocks; i++)
+    pthread_mutex_init(&bitmap_locks[i], NULL);
+  journaling = false;
+  pthread_mutex_init(&journal_mutex, NULL);
+  pthread_cond_init(&journal_cond, NULL);
+  running_seq = 1;
+  committed_seq = 0;
+  nops = 0;
+  draining = false;
+  in_commit = false;
+  running_bytes = 0;
+  window_usec = 0;
+  window_bytes = 0;
+  dedup = sync_mode & disk::DEDUP;
+  pthread_mutex_init(&ref_mutex, NULL);
+  refs.resize(NREFS * RPB);
+  nshared = 0;
+
+  read_block(1, buf);
+  memcpy(&sb, buf, sizeof(sb));
+  if (sb.magic == SB_MAGIC && sb.nblocks == BLOCK_NUM && sb.ninodes == INODE_NUM) {
+    replay_journal();
+    for (uint32_t b = 0; b < NREFS; b++)
+      read_block(RBLOCK(sb.nblocks) + b, (char *) &refs[b * RPB]);
+    for (blockid_t id = 0; id < sb.nblocks; id++)
+      if (refs[id] > 0)
+        nshared++;
+    journaling = image && (sync_mode & disk::SYNC_MASK) == disk::SYNC_FULL;
+    return;
+  }
 
   // format the disk
+  sb.magic = SB_MAGIC;
   sb.size = BLOCK_SIZE * BLOCK_NUM;
   sb.nblocks = BLOCK_NUM;
   sb.ninodes = INODE_NUM;
 
+  // the metadata blocks are in use; so are inode 0 (never handed
+  // out) and the root inode 1
+  init_bitmap(BBLOCK(0), sb.nblocks, data_start);
+  init_bitmap(IBMBLOCK(0, sb.nblocks), sb.ninodes + 1, 2);
+
+  // clear the inode table left over from an unformatted image
+  bzero(buf, sizeof(buf));
+  for (blockid_t b = IBLOCK(0, sb.nblocks); b <= IBLOCK(INODE_NUM, sb.nblocks); b++)
+    write_block(b, buf);
+  // and any journal and reference counts it carries
+  write_block(JBLOCK(sb.nblocks), buf);
+  for (uint32_t b = 0; b < NREFS; b++)
+    write_block(RBLOCK(sb.nblocks) + b, buf);
+
+  memcpy(buf, &sb, sizeof(sb));
+  write_block(1, buf);
+  sync();
+  journaling = image && (sync_mode & disk::SYNC_MASK) == disk::SYNC_FULL;
 }
 
 void
@@ -68,76 +629,952 @@ block_manager::read_block(uint32_t id, char *buf)
   d->read_block(id, buf);
 }
 
+// Data writes. A block freed as metadata may come back as data, so
+// drop what the journal still holds for it.
 void
 block_manager::write_block(uint32_t id, const char *buf)
 {
+  forget_blocks(id, 1);
   d->write_block(id, buf);
 }
 
+void
+block_manager::read_blocks(uint32_t id, uint32_t n, char *buf)
+{
+  d->read_blocks(id, n, buf);
+}
+
+void
+block_manager::write_blocks(uint32_t id, uint32_t n, const char *buf)
+{
+  forget_blocks(id, n);
+  d->write_blocks(id, n, buf);
+}
+
+void
+block_manager::forget_blocks(blockid_t id, uint32_t n)
+{
+  if (!journaling)
+    return;
+  ScopedLock ml(&journal_mutex);
+  account(n);
+  if (running.empty() && committing.empty())
+    return;
+  for (blockid_t b = id; b < id + n; b++) {
+    running.erase(b);
+    // the committing transaction may be being logged; just keep its
+    // checkpoint off the block
+    if (committing.count(b))
+      forgotten.insert(b);
+  }
+}
+
+// Metadata blocks: bitmaps, the inode table and index blocks.
+void
+block_manager::read_meta_block(uint32_t id, char *buf)
+{
+  if (journaling) {
+    ScopedLock ml(&journal_mutex);
+    std::map<blockid_t, std::string>::iterator it = running.find(id);
+    if (it == running.end()) {
+      it = committing.find(id);
+      if (it == committing.end() || forgotten.count(id)) {
+        d->read_block(id, buf);
+        return;
+      }
+    }
+    memcpy(buf, it->second.data(), BLOCK_SIZE);
+    return;
+  }
+  d->read_block(id, buf);
+}
+
+void
+block_manager::write_meta_block(uint32_t id, const char *buf)
+{
+  if (journaling) {
+    ScopedLock ml(&journal_mutex);
+    running[id].assign(buf, BLOCK_SIZE);
+    account(1);
+    return;
+  }
+  d->write_block(id, buf);
+}
+
+// Count n blocks written in the running transaction, waking a commit
+// that waits for its window to fill. Called with journal_mutex held.
+void
+block_manager::account(uint32_t n)
+{
+  uint64_t before = running_bytes;
+  running_bytes += (uint64_t) n * BLOCK_SIZE;
+  if (window_bytes && before < window_bytes && running_bytes >= window_bytes)
+    pthread_cond_broadcast(&journal_cond);
+}
+
+// Let a commit wait up to usec microseconds, or until bytes have been
+// written, for more operations to join it. Zero turns either off.
+void
+block_manager::set_commit_window(uint32_t usec, uint32_t bytes)
+{
+  ScopedLock ml(&journal_mutex);
+  window_usec = usec;
+  window_bytes = bytes;
+}
+
+// Whether the running transaction should commit before another
+// operation joins it.
+bool
+block_manager::journal_full()
+{
+  if (!journaling)
+    return false;
+  ScopedLock ml(&journal_mutex);
+  return running.size() >= JFULL;
+}
+
+// Bracket an operation that updates metadata, so that a commit never
+// takes in half of it. Call begin_op before taking any inode lock.
+void
+block_manager::begin_op()
+{
+  if (!journaling)
+    return;
+  ScopedLock ml(&journal_mutex);
+  while (draining)
+    pthread_cond_wait(&journal_cond, &journal_mutex);
+  nops++;
+}
+
+void
+block_manager::end_op()
+{
+  if (!journaling)
+    return;
+  ScopedLock ml(&journal_mutex);
+  if (--nops == 0)
+    pthread_cond_broadcast(&journal_cond);
+}
+
+// Log the committing transaction: flush the home blocks of the last
+// one, whose journal copy is about to be overwritten, then drop that
+// copy; then write the body with the data it depends on and finally
+// the header that commits it. Return false, with nothing written, if
+// it does not fit in the journal.
+bool
+block_manager::write_journal(uint64_t seq)
+{
+  char buf[BLOCK_SIZE];
+  jheader_t *h = (jheader_t *) buf;
+  blockid_t *ids = (blockid_t *) buf;
+  blockid_t jb = JBLOCK(sb.nblocks);
+  uint32_t n = committing.size();
+  uint32_t nids = (n + BLOCK_SIZE / sizeof(blockid_t) - 1) / (BLOCK_SIZE / sizeof(blockid_t));
+  if (1 + nids + n > NJOURNAL)
+    return false;
+  // msync does not order the blocks it flushes, so the checkpoint must
+  // be on disk before the header goes
+  d->sync();
+  // drop the previous transaction next: left in place, a replay
+  // would write it over the home blocks of this one
+  bzero(buf, sizeof(buf));
+  d->write_block(jb, buf);
+  d->sync();
+
+  std::map<blockid_t, std::string>::iterator it = committing.begin();
+  blockid_t copy = jb + 1 + nids;
+  for (uint32_t i = 0; i < nids; i++) {
+    bzero(buf, sizeof(buf));
+    for (uint32_t j = 0; j < BLOCK_SIZE / sizeof(blockid_t) && it != committing.end(); j++, ++it) {
+      ids[j] = it->first;
+      d->write_block(copy++, it->second.data());
+    }
+    d->write_block(jb + 1 + i, buf);
+  }
+  d->sync();
+
+  bzero(buf, sizeof(buf));
+  h->magic = JMAGIC;
+  h->n = n;
+  h->seq = seq;
+  d->write_block(jb, buf);
+  d->sync();
+  return true;
+}
+
+// Redo the transaction left in the journal, in case a crash kept it
+// from reaching its home blocks. Its header stays valid until the
+// next commit, so a replay is always safe.
+void
+block_manager::replay_journal()
+{
+  char buf[BLOCK_SIZE], ids[BLOCK_SIZE];
+  blockid_t jb = JBLOCK(sb.nblocks);
+  uint32_t per = BLOCK_SIZE / sizeof(blockid_t);
+  d->read_block(jb, buf);
+  jheader_t h = *(jheader_t *) buf;
+  if (h.magic != JMAGIC || h.n == 0)
+    return;
+  uint32_t nids = (h.n + per - 1) / per;
+  for (uint32_t i = 0; i < h.n; i++) {
+    if (i % per == 0)
+      d->read_block(jb + 1 + i / per, ids);
+    d->read_block(jb + 1 + nids + i, buf);
+    d->write_block(((blockid_t *) ids)[i % per], buf);
+  }
+  d->sync();
+  bzero(buf, sizeof(buf));
+  d->write_block(jb, buf);
+  d->sync();
+  printf("\tbm: replayed %u journaled blocks.\n", h.n);
+}
+
+// Make the updates so far durable. Without a journal that is a plain
+// disk sync. With one it is a group commit: whichever caller finds
+// no commit under way leads the next one, which takes in the updates
+// of every operation finished by then, while the others wait for it.
+// A commit window holds the leader back a little so that more
+// concurrent writers can share its flushes.
+void
+block_manager::sync()
+{
+  if (!journaling) {
+    d->sync();
+    return;
+  }
+  ScopedLock ml(&journal_mutex);
+  uint64_t mine = running_seq;
+  while (committed_seq < mine) {
+    if (in_commit) {
+      pthread_cond_wait(&journal_cond, &journal_mutex);
+      continue;
+    }
+    in_commit = true;
+    if (window_usec) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (long) (window_usec % 1000000) * 1000;
+      deadline.tv_sec += window_usec / 1000000 + deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while (!window_bytes || running_bytes < window_bytes) {
+        if (pthread_cond_timedwait(&journal_cond, &journal_mutex, &deadline) != 0)
+          break;
+      }
+    }
+    draining = true;
+    while (nops > 0)
+      pthread_cond_wait(&journal_cond, &journal_mutex);
+    uint64_t seq = running_seq++;
+    committing.swap(running);
+    freed_committing.swap(freed_running);
+    running_bytes = 0;
+    draining = false;
+    pthread_cond_broadcast(&journal_cond);
+
+    // new operations go on in the next transaction meanwhile
+    pthread_mutex_unlock(&journal_mutex);
+    bool logged = committing.empty() || write_journal(seq);
+    pthread_mutex_lock(&journal_mutex);
+    if (!logged) {
+      // writing it home unlogged would not be atomic; the disk still
+      // holds the last commit whole
+      printf("\tbm: error! transaction of %u blocks too big for the journal.\n",
+             (uint32_t) committing.size());
+      exit(1);
+    }
+    // checkpoint: the home blocks are flushed by the next commit
+    std::map<blockid_t, std::string>::iterator it;
+    for (it = committing.begin(); it != committing.end(); ++it)
+      if (!forgotten.count(it->first))
+        d->write_block(it->first, it->second.data());
+    committing.clear();
+    forgotten.clear();
+    freed_committing.clear();
+    committed_seq = seq;
+    in_commit = false;
+    pthread_cond_broadcast(&journal_cond);
+  }
+}
+
 // inode layer -----------------------------------------
 
 // private helpers
 #define ROUND_UP_DEVISION(a, b) { (a/b) + (a%b==0 ? 0:1) }
 
+// Brackets one public operation as a unit of the journal.
+struct scoped_op {
+    inode_manager *im;
+    scoped_op(inode_manager *i) : im(i) { im->begin_op(); }
+    ~scoped_op() { im->end_op(); }
+};
+
+// Commit first if the running transaction is getting too big for the
+// journal; its dirty inodes go with it. Call with no inode lock held.
+void
+inode_manager::begin_op()
+{
+    if (bm->journal_full()) {
+        sync();
+    }
+    bm->begin_op();
+}
+
+void
+inode_manager::end_op()
+{
+    bm->end_op();
+}
+
+// Split data block index into the inode slot that roots it and the
+// entries to follow through its index blocks, top level first.
+// Return the number of index blocks on the way (0 for a direct block).
+int
+inode_manager::block_path(uint32_t index, uint32_t *root, uint32_t path[NLEVELS]) {
+    if (index < NDIRECT) {
+        *root = index;
+        return 0;
+    }
+    index -= NDIRECT;
+    uint32_t span = NINDIRECT;
+    for (int depth = 1; depth <= NLEVELS; depth++) {
+        if (index < span) {
+            *root = NDIRECT + depth - 1;
+            for (int l = depth - 1; l >= 0; l--) {
+                path[l] = index % NINDIRECT;
+                index /= NINDIRECT;
+            }
+            return depth;
+        }
+        index -= span;
+        span *= NINDIRECT;
+    }
+    printf("\tim: error! block index beyond MAXFILE.\n");
+    exit(0);
+}
+
+// Return the slot holding the address of data block index of a
+// block-mapped inode: in the inode itself or in its leaf index block,
+// loaded into p. With alloc set, missing index blocks are allocated
+// and the leaf is marked dirty for the caller to fill in the slot;
+// otherwise return NULL if the block was never mapped.
+blockid_t *
+inode_manager::index_slot(struct inode *ino, struct index_path *p, uint32_t index, bool alloc) {
+    uint32_t root, path[NLEVELS];
+    int depth = block_path(index, &root, path);
+    blockid_t *slot = &ino->blocks[root];
+    for (int l = 0; l < depth; l++) {
+        if (*slot == 0) {
+            if (!alloc) {
+                return NULL;
+            }
+            // a fresh index block is only written on flush
+            *slot = bm->alloc_block();
+            if (l > 0) {
+                p->dirty[l - 1] = true;
+            }
+            flush_index(p, l);
+            p->id[l] = *slot;
+            bzero(p->slots[l], sizeof(p->slots[l]));
+            p->dirty[l] = true;
+        } else if (p->id[l] != *slot) {
+            flush_index(p, l);
+            p->id[l] = *slot;
+            bm->read_meta_block(*slot, (char *) p->slots[l]);
+        }
+        slot = &p->slots[l][path[l]];
+    }
+    if (alloc && depth > 0) {
+        p->dirty[depth - 1] = true;
+    }
+    return slot;
+}
+
+// Write back the index block cached at level l of p if it is dirty,
+// or all of them if l is negative.
+void
+inode_manager::flush_index(struct index_path *p, int l) {
+    for (int i = (l < 0 ? 0 : l); i < (l < 0 ? NLEVELS : l + 1); i++) {
+        if (p->dirty[i]) {
+            bm->write_meta_block(p->id[i], (const char *) p->slots[i]);
+            p->dirty[i] = false;
+        }
+    }
+}
+
+// Return the number of data blocks mapped by the extents of ino.
+uint32_t
+inode_manager::extent_blocks(struct inode *ino) {
+    struct extent *ext = (struct extent *) ino->blocks;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < NEXTENT && ext[i].len != 0; i++) {
+        n += ext[i].len;
+    }
+    return n;
+}
+
+// Find the extent mapping data block index. Set *blk to its block and
+// return how many blocks the extent still maps contiguously from
+// there, or 0 if index is not mapped.
+uint32_t
+inode_manager::extent_lookup(struct inode *ino, uint32_t index, blockid_t *blk) {
+    struct extent *ext = (struct extent *) ino->blocks;
+    uint32_t base = 0;
+    for (uint32_t i = 0; i < NEXTENT && ext[i].len != 0; i++) {
+        if (index < base + ext[i].len) {
+            // a hole extent starts at block 0
+            *blk = ext[i].start ? ext[i].start + (index - base) : 0;
+            return ext[i].len - (index - base);
+        }
+        base += ext[i].len;
+    }
+    return 0;
+}
+
+// Map the run of n blocks at blk right after the last mapped block,
+// growing the last extent when the run continues it; blk 0 maps a
+// hole. Return false if the inode has no extent slot left.
+bool
+inode_manager::append_extent(struct inode *ino, blockid_t blk, uint32_t n) {
+    struct extent *ext = (struct extent *) ino->blocks;
+    uint32_t i = 0;
+    while (i < NEXTENT && ext[i].len != 0) {
+        i++;
+    }
+    if (i > 0 && (ext[i - 1].start == 0) == (blk == 0) &&
+        (blk == 0 || ext[i - 1].start + ext[i - 1].len == blk)) {
+        ext[i - 1].len += n;
+        return true;
+    }
+    if (i == NEXTENT) {
+        return false;
+    }
+    ext[i].start = blk;
+    ext[i].len = n;
+    return true;
+}
+
+// Switch a file that outgrew its extent slots to the block map,
+// keeping every block where it is.
+void
+inode_manager::extents_to_blockmap(struct inode *ino) {
+    struct extent *ext = (struct extent *) ino->blocks;
+    std::vector<blockid_t> ids;
+    for (uint32_t i = 0; i < NEXTENT && ext[i].len != 0; i++) {
+        for (uint32_t j = 0; j < ext[i].len; j++) {
+            ids.push_back(ext[i].start ? ext[i].start + j : 0);
+        }
+    }
+    bzero(ino->blocks, sizeof(ino->blocks));
+    ino->flags &= ~I_EXTENTS;
+    struct index_path p;
+    bzero(&p, sizeof(p));
+    for (uint32_t i = 0; i < ids.size(); i++) {
+        if (ids[i] != 0) {
+            *index_slot(ino, &p, i, true) = ids[i];
+        }
+    }
+    flush_index(&p, -1);
+}
+
+// Return the block backing data block index, or 0 for a hole, and set
+// *run to how many blocks from there on are contiguous on disk, or
+// holes as well, looking no further than the index block it is
+// mapped by.
 blockid_t
-inode_manager::get_blockid_in_inode(struct inode *ino, uint32_t index) {
+inode_manager::map_run(struct inode *ino, struct index_path *p, uint32_t index, uint32_t *run) {
+    if (ino->flags & I_EXTENTS) {
+        blockid_t blk = 0;
+        *run = extent_lookup(ino, index, &blk);
+        return blk;
+    }
+    blockid_t *slot = index_slot(ino, p, index, false);
+    *run = 1;
+    if (slot == NULL) {
+        return 0;
+    }
+    // the slots of a run share the inode or one leaf index block
+    uint32_t left;
     if (index < NDIRECT) {
-        return ino->blocks[index];
+        left = NDIRECT - index;
+    } else {
+        left = NINDIRECT - (uint32_t) (slot - p->slots[0]) % NINDIRECT;
     }
-    blockid_t inblock_id = ino->blocks[NDIRECT];
-    char inblock[BLOCK_SIZE];
-    bm->read_block(inblock_id, inblock);
-    return (((blockid_t *) inblock)[index - NDIRECT]);
+    // a run of holes, or of contiguous blocks
+    while (*run < left && (slot[0] == 0 ? slot[*run] == 0 :
+                           slot[*run] != 0 && slot[*run] == slot[0] + *run)) {
+        (*run)++;
+    }
+    return slot[0];
 }
 
+// Map newly allocated blocks at data block indexes [from, to); their
+// content is left as is. Extent-mapped files grab contiguous runs
+// and fall back to the block map once they run out of extent slots.
+// The index blocks touched are written back once at the end.
 void
-inode_manager::read_block_in_inode(struct inode *ino, uint32_t index, std::string &buf) {
-    blockid_t bl_id = get_blockid_in_inode(ino, index);
-    char content[BLOCK_SIZE];
-    bm->read_block(bl_id, content);
-    buf.assign(content, BLOCK_SIZE);
+inode_manager::alloc_blocks_in_inode(struct inode *ino, uint32_t from, uint32_t to) {
+    struct index_path p;
+    bzero(&p, sizeof(p));
+    while (from < to) {
+        if (!(ino->flags & I_EXTENTS)) {
+            *index_slot(ino, &p, from, true) = bm->alloc_block();
+            from++;
+            continue;
+        }
+        if (from != extent_blocks(ino)) {
+            extents_to_blockmap(ino);
+            continue;
+        }
+        struct extent *ext = (struct extent *) ino->blocks;
+        blockid_t goal = 0;
+        for (uint32_t i = 0; i < NEXTENT && ext[i].len != 0; i++) {
+            if (ext[i].start != 0) {
+                goal = ext[i].start + ext[i].len;
+            }
+        }
+        uint32_t got;
+        blockid_t blk = bm->alloc_run(goal, to - from, &got);
+        if (!append_extent(ino, blk, got)) {
+            extents_to_blockmap(ino);
+            for (uint32_t i = 0; i < got; i++) {
+                *index_slot(ino, &p, from + i, true) = blk + i;
+            }
+        }
+        from += got;
+    }
+    flush_index(&p, -1);
 }
 
+// Copy len bytes at byte offset off of the file into buf, a run of
+// contiguous blocks at a time. Holes read back as zeros.
 void
-inode_manager::write_block_in_inode(struct inode *ino, uint32_t index, std::string &buf) {
-    blockid_t bl_id = get_blockid_in_inode(ino, index);
-    bm->write_block(bl_id, buf.data());
+inode_manager::read_bytes(struct inode *ino, uint32_t off, uint32_t len, char *buf) {
+    char block[BLOCK_SIZE];
+    struct index_path p;
+    bzero(&p, sizeof(p));
+    uint32_t pos = off, end = off + len;
+    while (pos < end) {
+        uint32_t run;
+        blockid_t blk = map_run(ino, &p, pos / BLOCK_SIZE, &run);
+        uint32_t blk_off = pos % BLOCK_SIZE;
+        if (blk == 0) {
+            uint32_t n = (run ? run : 1) * BLOCK_SIZE - blk_off;
+            if (n > end - pos) {
+                n = end - pos;
+            }
+            bzero(buf + (pos - off), n);
+            pos += n;
+            continue;
+        }
+        if (blk_off != 0 || end - pos < BLOCK_SIZE) {
+            uint32_t n = BLOCK_SIZE - blk_off;
+            if (n > end - pos) {
+                n = end - pos;
+            }
+            bm->read_block(blk, block);
+            memcpy(buf + (pos - off), block + blk_off, n);
+            pos += n;
+            continue;
+        }
+        uint32_t nblocks = (end - pos) / BLOCK_SIZE;
+        if (nblocks > run) {
+            nblocks = run;
+        }
+        bm->read_blocks(blk, nblocks, buf + (pos - off));
+        pos += nblocks * BLOCK_SIZE;
+    }
 }
 
+// Copy len bytes from buf into the file at byte offset off, a run of
+// contiguous blocks at a time. The blocks must already be mapped,
+// holes filled.
+void
+inode_manager::write_bytes(struct inode *ino, uint32_t off, uint32_t len, const char *buf) {
+    char block[BLOCK_SIZE];
+    struct index_path p;
+    bzero(&p, sizeof(p));
+    uint32_t pos = off, end = off + len;
+    while (pos < end) {
+        uint32_t run;
+        blockid_t blk = map_run(ino, &p, pos / BLOCK_SIZE, &run);
+        if (blk == 0) {
+            printf("\tim: error! write to a hole.\n");
+            return;
+        }
+        uint32_t blk_off = pos % BLOCK_SIZE;
+        if (blk_off != 0 || end - pos < BLOCK_SIZE) {
+            uint32_t n = BLOCK_SIZE - blk_off;
+            if (n > end - pos) {
+                n = end - pos;
+            }
+            bm->read_block(blk, block);
+            memcpy(block + blk_off, buf + (pos - off), n);
+            bm->write_block(blk, block);
+            pos += n;
+            continue;
+        }
+        uint32_t nblocks = (end - pos) / BLOCK_SIZE;
+        if (nblocks > run) {
+            nblocks = run;
+        }
+        bm->write_blocks(blk, nblocks, buf + (pos - off));
+        pos += nblocks * BLOCK_SIZE;
+    }
+}
 
+// Map the n blocks from blk on at data block index on, right after
+// the last mapped block; blk 0 maps a hole of n blocks.
 void
-inode_manager::alloc_block_in_inode(struct inode *ino, uint32_t index, std::string &buf, bool write_through) {
-    blockid_t blk_id = bm->alloc_block();
-    if (write_through) {
-        bm->write_block(blk_id, buf.data());
+inode_manager::append_blocks(struct inode *ino, struct index_path *p, uint32_t index, blockid_t blk, uint32_t n) {
+    if (ino->flags & I_EXTENTS) {
+        if (append_extent(ino, blk, n)) {
+            return;
+        }
+        extents_to_blockmap(ino);
     }
-    if (index < NDIRECT) {
-        ino->blocks[index] = blk_id;
+    // holes in the block map are slots left at 0
+    for (uint32_t i = 0; blk != 0 && i < n; i++) {
+        *index_slot(ino, p, index + i, true) = blk + i;
+    }
+}
+
+// Back the holes among data blocks [from, to) with blocks of their
+// own, about to be written over [off, end); those the write does not
+// cover whole are zeroed. A hole amid extents takes the file to the
+// block map.
+void
+inode_manager::fill_holes(struct inode *ino, uint32_t from, uint32_t to, uint32_t off, uint32_t end) {
+    char zero[BLOCK_SIZE];
+    bzero(zero, BLOCK_SIZE);
+    struct index_path p;
+    bzero(&p, sizeof(p));
+    while (from < to) {
+        uint32_t run;
+        blockid_t blk = map_run(ino, &p, from, &run);
+        if (run == 0 || run > to - from) {
+            run = to - from;
+        }
+        if (blk != 0) {
+            from += run;
+            continue;
+        }
+        if (ino->flags & I_EXTENTS) {
+            extents_to_blockmap(ino);
+            continue;
+        }
+        for (uint32_t i = 0; i < run; i++, from++) {
+            blockid_t nb = bm->alloc_block();
+            if (from * BLOCK_SIZE < off || (from + 1) * BLOCK_SIZE > end) {
+                bm->write_block(nb, zero);
+            }
+            *index_slot(ino, &p, from, true) = nb;
+        }
+    }
+    flush_index(&p, -1);
+}
+
+// Give the file a copy of its own of each block it shares with other
+// files at data block indexes [from, to), so that it can be written
+// in place. A copied block is remapped, which takes the file off
+// extents.
+void
+inode_manager::unshare_blocks(struct inode *ino, uint32_t from, uint32_t to) {
+    char block[BLOCK_SIZE];
+    struct index_path p;
+    bzero(&p, sizeof(p));
+    while (from < to) {
+        uint32_t run;
+        blockid_t blk = map_run(ino, &p, from, &run);
+        if (run > to - from) {
+            run = to - from;
+        }
+        if (blk == 0 || bm->own_blocks(blk, run)) {
+            from += run;
+            continue;
+        }
+        for (uint32_t i = 0; i < run; i++, from++) {
+            if (bm->own_blocks(blk + i, 1)) {
+                continue;
+            }
+            if (ino->flags & I_EXTENTS) {
+                extents_to_blockmap(ino);
+            }
+            blockid_t copy = bm->alloc_block();
+            bm->read_block(blk + i, block);
+            bm->write_block(copy, block);
+            *index_slot(ino, &p, from, true) = copy;
+            bm->free_block(blk + i);
+        }
+    }
+    flush_index(&p, -1);
+}
+
+// Whether the block at buf is all zeros.
+static bool
+zero_block(const char *buf) {
+    const uint64_t *words = (const uint64_t *) buf;
+    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Store len bytes of buf in fresh blocks, the last one padded with
+// zeros. All-zero blocks are left as holes. With dedup, a block whose
+// content some block on disk already holds maps that block instead.
+void
+inode_manager::store_bytes(struct inode *ino, const char *buf, uint32_t len) {
+    uint32_t nblocks = ROUND_UP_DEVISION(len, BLOCK_SIZE);
+    char last[BLOCK_SIZE];
+    bzero(last, BLOCK_SIZE);
+    if (len % BLOCK_SIZE != 0) {
+        memcpy(last, buf + len - len % BLOCK_SIZE, len % BLOCK_SIZE);
+    }
+    // start over on extents
+    free_blocks_in_inode(ino, 0);
+    ino->flags |= I_EXTENTS;
+    struct index_path p;
+    bzero(&p, sizeof(p));
+    blockid_t goal = 0;
+    uint32_t i = 0;
+    while (i < nblocks) {
+        const char *data = (i + 1) * BLOCK_SIZE <= len ? buf + i * BLOCK_SIZE : last;
+        if (zero_block(data)) {
+            append_blocks(ino, &p, i, 0, 1);
+            i++;
+            continue;
+        }
+        if (bm->deduping()) {
+            blockid_t blk = bm->find_dup(data);
+            if (blk == 0) {
+                uint32_t got;
+                blk = bm->alloc_run(goal, 1, &got);
+                goal = blk + 1;
+                bm->write_block(blk, data);
+                bm->add_fingerprint(blk, data);
+            }
+            append_blocks(ino, &p, i, blk, 1);
+            i++;
+            continue;
+        }
+        // a run of blocks with data, contiguous on disk if possible
+        uint32_t j = i + 1;
+        while (j < nblocks && !zero_block((j + 1) * BLOCK_SIZE <= len ? buf + j * BLOCK_SIZE : last)) {
+            j++;
+        }
+        uint32_t got;
+        blockid_t blk = bm->alloc_run(goal, j - i, &got);
+        goal = blk + got;
+        uint32_t full = got;
+        if (i + got == nblocks && len % BLOCK_SIZE != 0) {
+            full--;
+        }
+        if (full > 0) {
+            bm->write_blocks(blk, full, buf + i * BLOCK_SIZE);
+        }
+        if (full < got) {
+            bm->write_block(blk + full, last);
+        }
+        append_blocks(ino, &p, i, blk, got);
+        i += got;
     }
-    else {
-        blockid_t inblock_id = ino->blocks[NDIRECT];
-        char inblock[BLOCK_SIZE];
-        bm->read_block(inblock_id, inblock);
-        (((blockid_t *) inblock)[index - NDIRECT]) = blk_id;
-        bm->write_block(inblock_id, inblock);
+    flush_index(&p, -1);
+}
+
+// Pack size bytes of buf into out as ZCHUNK chunks, each compressed
+// unless that saves nothing. Return false if the packed data would
+// not take fewer blocks.
+static bool
+compress_chunks(const char *buf, uint32_t size, std::string &out) {
+    uint32_t nchunks = ROUND_UP_DEVISION(size, ZCHUNK);
+    std::vector<uint32_t> table(nchunks);
+    std::vector<char> tmp(ZCHUNK);
+    std::string data;
+    for (uint32_t c = 0; c < nchunks; c++) {
+        const char *chunk = buf + c * ZCHUNK;
+        uint32_t n = std::min(size - c * ZCHUNK, (uint32_t) ZCHUNK);
+        int clen = lz_compress(chunk, n, &tmp[0], n - 1);
+        if (clen > 0) {
+            table[c] = clen;
+            data.append(&tmp[0], clen);
+        } else {
+            table[c] = n | ZRAW;
+            data.append(chunk, n);
+        }
+    }
+    uint32_t packed = nchunks * sizeof(uint32_t) + data.size();
+    uint32_t blk_num_packed = ROUND_UP_DEVISION(packed, BLOCK_SIZE);
+    uint32_t blk_num_raw = ROUND_UP_DEVISION(size, BLOCK_SIZE);
+    if (blk_num_packed >= blk_num_raw) {
+        return false;
     }
+    out.assign((const char *) &table[0], nchunks * sizeof(uint32_t));
+    out += data;
+    return true;
 }
 
+// Copy len bytes at byte offset off of a compressed file into buf,
+// decompressing only the chunks they fall in.
 void
-inode_manager::free_block_in_inode(struct inode *ino, uint32_t index) {
-    blockid_t id = get_blockid_in_inode(ino, index);
-    bm->free_block(id);
+inode_manager::read_compressed(struct inode *ino, uint32_t off, uint32_t len, char *buf) {
+    uint32_t nchunks = ROUND_UP_DEVISION(ino->size, ZCHUNK);
+    std::vector<uint32_t> table(nchunks);
+    std::vector<char> packed, plain;
+    read_bytes(ino, 0, nchunks * sizeof(uint32_t), (char *) &table[0]);
+    uint32_t pos = nchunks * sizeof(uint32_t), end = off + len;
+    for (uint32_t c = 0; c < nchunks && c * ZCHUNK < end; c++) {
+        uint32_t clen = table[c] & ~ZRAW;
+        uint32_t lo = c * ZCHUNK;
+        uint32_t hi = std::min(lo + ZCHUNK, ino->size);
+        if (clen > ino->csize - pos) {
+            printf("\tim: error! compressed chunk %u past the end.\n", c);
+            memset(buf + (std::max(lo, off) - off), 0, end - std::max(lo, off));
+            return;
+        }
+        if (hi > off) {
+            uint32_t from = std::max(lo, off), to = std::min(hi, end);
+            if (table[c] & ZRAW) {
+                read_bytes(ino, pos + (from - lo), to - from, buf + (from - off));
+            } else {
+                // a chunk read whole is decompressed in place
+                bool whole = from == lo && to == hi;
+                char *dst = buf + (from - off);
+                if (!whole) {
+                    plain.resize(ZCHUNK);
+                    dst = &plain[0];
+                }
+                packed.resize(clen);
+                read_bytes(ino, pos, clen, &packed[0]);
+                if (lz_decompress(&packed[0], clen, dst, hi - lo) != (int) (hi - lo)) {
+                    printf("\tim: error! bad compressed chunk %u.\n", c);
+                    memset(dst, 0, hi - lo);
+                }
+                if (!whole) {
+                    memcpy(buf + (from - off), dst + (from - lo), to - from);
+                }
+            }
+        }
+        pos += clen;
+    }
+}
+
+// Store a compressed file's data as is again, so that it can be
+// written in place.
+void
+inode_manager::uncompress_inode(struct inode *ino) {
+    std::vector<char> plain(ino->size);
+    read_compressed(ino, 0, ino->size, &plain[0]);
+    store_bytes(ino, &plain[0], ino->size);
+    ino->flags &= ~I_COMPRESSED;
+    ino->csize = 0;
+}
+
+// Free what index block ind maps from its keep-th data block on,
+// and ind itself if keep is 0. A depth 1 index block maps data
+// blocks directly.
+void
+inode_manager::free_index(blockid_t ind, int depth, uint32_t keep) {
+    char buf[BLOCK_SIZE];
+    blockid_t *slots = (blockid_t *) buf;
+    uint32_t span = 1;
+    for (int l = 1; l < depth; l++) {
+        span *= NINDIRECT;
+    }
+    bool dirty = false;
+    bm->read_meta_block(ind, buf);
+    for (uint32_t i = keep / span; i < NINDIRECT; i++) {
+        if (slots[i] == 0) {
+            continue;
+        }
+        uint32_t sub_keep = i * span < keep ? keep - i * span : 0;
+        if (depth == 1) {
+            bm->free_block(slots[i]);
+        } else {
+            free_index(slots[i], depth - 1, sub_keep);
+        }
+        if (sub_keep == 0) {
+            slots[i] = 0;
+            dirty = true;
+        }
+    }
+    if (keep == 0) {
+        bm->free_block(ind);
+    } else if (dirty) {
+        bm->write_meta_block(ind, buf);
+    }
+}
+
+// Free the data blocks from index from on, and the index blocks
+// that no longer map anything.
+void
+inode_manager::free_blocks_in_inode(struct inode *ino, uint32_t from) {
+    if (ino->flags & I_EXTENTS) {
+        struct extent *ext = (struct extent *) ino->blocks;
+        uint32_t base = 0;
+        for (uint32_t i = 0; i < NEXTENT && ext[i].len != 0; i++) {
+            uint32_t len = ext[i].len;
+            if (base + len > from) {
+                uint32_t keep = from > base ? from - base : 0;
+                if (ext[i].start != 0) {
+                    bm->free_run(ext[i].start + keep, len - keep);
+                }
+                ext[i].len = keep;
+                if (keep == 0) {
+                    ext[i].start = 0;
+                }
+            }
+            base += len;
+        }
+        return;
+    }
+    for (uint32_t i = from; i < NDIRECT; i++) {
+        if (ino->blocks[i] != 0) {
+            bm->free_block(ino->blocks[i]);
+            ino->blocks[i] = 0;
+        }
+    }
+    uint32_t base = NDIRECT, span = NINDIRECT;
+    for (int depth = 1; depth <= NLEVELS; depth++) {
+        blockid_t *root = &ino->blocks[NDIRECT + depth - 1];
+        uint32_t keep = from > base ? from - base : 0;
+        if (*root != 0 && keep < span) {
+            free_index(*root, depth, keep);
+            if (keep == 0) {
+                *root = 0;
+            }
+        }
+        base += span;
+        span *= NINDIRECT;
+    }
 }
 
 // public methods
-inode_manager::inode_manager()
+inode_manager::inode_manager(const char *image, int sync_mode)
 {
-  bm = new block_manager();
+  bm = new block_manager(image, sync_mode);
+  compress = sync_mode & disk::COMPRESS;
+  icache = new cached_inode[INODE_NUM + 1]();
+  for (uint32_t i = 0; i <= INODE_NUM; i++)
+    pthread_mutex_init(&icache[i].lock, NULL);
+  pthread_mutex_init(&icache_mutex, NULL);
+  pthread_mutex_init(&flush_mutex, NULL);
+  pthread_mutex_init(&itable_mutex, NULL);
+  inode_hint = 2;
+  if (get_inode(1)->type == extent_protocol::T_DIR)
+    return;
+
   struct inode root;
+  bzero(&root, sizeof(root));
   root.type = extent_protocol::T_DIR;
+  root.flags = I_EXTENTS;
   root.size = 0;
   root.atime = time(NULL);
+  root.mtime = time(NULL);
+  root.ctime = time(NULL);
   put_inode(1, &root);
+  sync();
 }
 
 /* Create a new file.
@@ -145,28 +1582,25 @@ inode_manager::inode_manager()
 uint32_t
 inode_manager::alloc_inode(uint32_t type)
 {
-    uint32_t inum = 0;
-    inode *ino;
-    for (uint32_t i = 2; i < INODE_NUM+1; i++) {
-        ino = get_inode(i);
-        if (ino->type == 0) {
-            inum = i;
-            break;
-        } else {
-            free(ino);
-        }
-    }
+    scoped_op op(this);
+    uint32_t inum = bm->alloc_bit(IBMBLOCK(0, bm->sb.nblocks), INODE_NUM + 1, inode_hint);
     if (!inum) {
         exit(0);
     }
+    ScopedLock il(inode_lock(inum));
+    inode *ino = get_inode(inum);
+    bzero(ino, sizeof(*ino));
     ino->type = (short) type;
+    ino->flags = I_EXTENTS;
     ino->size = 0;
     ino->atime = time(NULL);
+    ino->mtime = time(NULL);
+    ino->ctime = time(NULL);
     put_inode(inum, ino);
-    free(ino);
     return inum;
 }
 
+// The caller holds the lock of inum.
 void
 inode_manager::free_inode(uint32_t inum)
 {
@@ -176,37 +1610,117 @@ inode_manager::free_inode(uint32_t inum)
     }
     ino->type = 0;
     put_inode(inum, ino);
-    free(ino);
+    bm->free_bit(IBMBLOCK(0, bm->sb.nblocks), inum);
     return;
 }
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
+// The lock serializing the operations on inode inum.
+pthread_mutex_t *
+inode_manager::inode_lock(uint32_t inum)
+{
+    if (inum <= 0 || inum > INODE_NUM) {
+        exit(0);
+    }
+    return &icache[inum].lock;
+}
+
+/* Return the cached inode structure of inum, reading it from the
+ * inode table on a miss. A miss caches every inode packed in the
+ * same block. The structure stays owned by the cache; hand it back
+ * through put_inode after modifying it. The caller holds the lock
+ * of inum. */
 struct inode* 
 inode_manager::get_inode(uint32_t inum)
 {
-    struct inode *ino, *ino_disk;
+    struct cached_inode *ci;
     char buf[BLOCK_SIZE];
     if (inum <= 0 || inum > INODE_NUM) {
         exit(0);
     }
-    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-    ino_disk = (struct inode *) buf + inum % IPB;
-    ino = (struct inode *) malloc(sizeof(struct inode));
-    *ino = *ino_disk;
-    return ino;
+    ci = &icache[inum];
+    ScopedLock cl(&icache_mutex);
+    if (!ci->valid) {
+        bm->read_meta_block(IBLOCK(inum, bm->sb.nblocks), buf);
+        uint32_t first = inum - inum % IPB;
+        for (uint32_t i = first; i < first + IPB && i <= INODE_NUM; i++) {
+            if (!icache[i].valid) {
+                icache[i].ino = *((struct inode *) buf + i % IPB);
+                icache[i].valid = true;
+                icache[i].dirty = false;
+            }
+        }
+    }
+    return &ci->ino;
 }
 
+/* Update the cached inode; it is written back by sync. With a
+ * journal it goes into the running transaction right away instead,
+ * so that it commits together with the rest of the operation. */
 void
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
-    char buf[BLOCK_SIZE];
-    struct inode *ino_disk;
+    struct cached_inode *ci;
     assert(ino);
-    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-    ino_disk = (struct inode *) buf + inum % IPB;
-    *ino_disk = *ino;
-    bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+    ci = &icache[inum];
+    if (ino != &ci->ino) {
+        ci->ino = *ino;
+    }
+    if (bm->journaled()) {
+        char buf[BLOCK_SIZE];
+        ScopedLock tl(&itable_mutex);
+        bm->read_meta_block(IBLOCK(inum, bm->sb.nblocks), buf);
+        *((struct inode *) buf + inum % IPB) = ci->ino;
+        bm->write_meta_block(IBLOCK(inum, bm->sb.nblocks), buf);
+        ScopedLock cl(&icache_mutex);
+        ci->valid = true;
+        return;
+    }
+    ScopedLock cl(&icache_mutex);
+    ci->valid = true;
+    if (!ci->dirty) {
+        ci->dirty = true;
+        dirty_inodes.push_back(inum);
+    }
+}
+
+/* Write the dirty cached inodes back to the inode table, one
+ * read-modify-write per inode table block. Each inode is copied
+ * under its own lock, so the caller must not hold any. */
+void
+inode_manager::flush_inodes()
+{
+    char buf[BLOCK_SIZE];
+    std::vector<uint32_t> inums;
+    ScopedLock fl(&flush_mutex);
+    {
+        ScopedLock cl(&icache_mutex);
+        inums.swap(dirty_inodes);
+        // an inode dirtied again from here on is queued anew
+        for (uint32_t i = 0; i < inums.size(); i++) {
+            icache[inums[i]].dirty = false;
+        }
+    }
+    std::sort(inums.begin(), inums.end());
+    for (uint32_t i = 0; i < inums.size(); ) {
+        blockid_t b = IBLOCK(inums[i], bm->sb.nblocks);
+        struct inode copy[IPB];
+        bool have[IPB] = { false };
+        for (; i < inums.size() && IBLOCK(inums[i], bm->sb.nblocks) == b; i++) {
+            uint32_t inum = inums[i];
+            ScopedLock il(inode_lock(inum));
+            copy[inum % IPB] = icache[inum].ino;
+            have[inum % IPB] = true;
+        }
+        // a cache miss may be reading this block meanwhile
+        ScopedLock cl(&icache_mutex);
+        bm->read_meta_block(b, buf);
+        for (uint32_t k = 0; k < IPB; k++) {
+            if (have[k]) {
+                *((struct inode *) buf + k) = copy[k];
+            }
+        }
+        bm->write_meta_block(b, buf);
+    }
 }
 
 /* Get all the data of a file by inum. 
@@ -214,87 +1728,228 @@ inode_manager::put_inode(uint32_t inum, struct inode *ino)
 void
 inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
 {
+    scoped_op op(this);
+    ScopedLock il(inode_lock(inum));
     struct inode *ino = get_inode(inum);
     *size = ino->size;
     if (ino->size == 0){
         return;
     }
-    if (ino->size > MAXFILE * BLOCK_SIZE) {
-        exit(0);
+    *buf_out = (char *) malloc(ino->size);
+    read_locked(inum, 0, ino->size, *buf_out);
+}
+
+/* Copy at most len bytes of the file starting at off straight into
+ * buf, which the caller sized to hold them.
+ * Return the number of bytes read. */
+uint32_t
+inode_manager::read_at(uint32_t inum, uint32_t off, uint32_t len, char *buf)
+{
+    scoped_op op(this);
+    ScopedLock il(inode_lock(inum));
+    return read_locked(inum, off, len, buf);
+}
+
+// read_at for a caller already holding the lock of inum.
+uint32_t
+inode_manager::read_locked(uint32_t inum, uint32_t off, uint32_t len, char *buf)
+{
+    struct inode *ino = get_inode(inum);
+    if (off >= ino->size || len == 0) {
+        return 0;
+    }
+    if (len > ino->size - off) {
+        len = ino->size - off;
     }
-    uint32_t block_num = ROUND_UP_DEVISION(ino->size, BLOCK_SIZE);
-    char *buf_content = (char *) malloc(BLOCK_NUM * BLOCK_SIZE);
-    std::string content;
-    for (uint32_t i = 0; i < block_num; i++) {
-        read_block_in_inode(ino, i, content);
-        memcpy(buf_content + i * BLOCK_SIZE, content.data(), BLOCK_SIZE);
+    if (ino->flags & I_COMPRESSED) {
+        read_compressed(ino, off, len, buf);
+    } else {
+        read_bytes(ino, off, len, buf);
     }
-    *buf_out = buf_content;
     ino->atime = time(NULL);
     put_inode(inum, ino);
-    free(ino);
+    return len;
 }
 
-/* alloc/free blocks if needed */
+/* Replace the contents of the file; with compression on, the data
+ * is stored compressed if that saves blocks. */
 void
 inode_manager::write_file(uint32_t inum, const char *buf, int size)
 {
+    if ((uint64_t) (unsigned int) size > (uint64_t) MAXFILE * BLOCK_SIZE) {
+        printf("\tim: error! write beyond MAXFILE.\n");
+        return;
+    }
+    std::string packed;
+    bool packs = compress && compress_chunks(buf, (uint32_t) size, packed);
+    scoped_op op(this);
+    ScopedLock il(inode_lock(inum));
+    inode *ino = get_inode(inum);
+    if (packs) {
+        store_bytes(ino, packed.data(), packed.size());
+        ino->flags |= I_COMPRESSED;
+        ino->csize = packed.size();
+    } else {
+        store_bytes(ino, buf, (uint32_t) size);
+        ino->flags &= ~I_COMPRESSED;
+        ino->csize = 0;
+    }
+    ino->size = (unsigned int) size;
+    ino->atime = time(NULL);
+    ino->mtime = time(NULL);
+    ino->ctime = time(NULL);
+    put_inode(inum, ino);
+}
+
+/* Read at most len bytes starting at off.
+ * Only the blocks covering [off, off+len) are touched.
+ * Return alloced data of exactly *size bytes, should be freed by caller. */
+void
+inode_manager::read_range(uint32_t inum, uint32_t off, uint32_t len, char **buf_out, int *size)
+{
+    scoped_op op(this);
+    ScopedLock il(inode_lock(inum));
+    struct inode *ino = get_inode(inum);
+    *size = 0;
+    if (off >= ino->size || len == 0) {
+        return;
+    }
+    if (len > ino->size - off) {
+        len = ino->size - off;
+    }
+    *buf_out = (char *) malloc(len);
+    *size = (int) read_locked(inum, off, len, *buf_out);
+}
+
+/* Write size bytes at off, growing the file if needed.
+ * A gap between the old end of file and off reads back as zeros.
+ * Only the blocks covering [off, off+size) and the gap are touched. */
+void
+inode_manager::write_range(uint32_t inum, uint32_t off, const char *buf, int size)
+{
+    uint32_t end = off + (uint32_t) size;
+    if (size <= 0) {
+        return;
+    }
+    if ((uint64_t) off + size > (uint64_t) MAXFILE * BLOCK_SIZE) {
+        printf("\tim: error! write beyond MAXFILE.\n");
+        return;
+    }
+    scoped_op op(this);
+    ScopedLock il(inode_lock(inum));
     inode *ino = get_inode(inum);
+    if (ino->flags & I_COMPRESSED) {
+        uncompress_inode(ino);
+    }
     uint32_t blk_num_ori = ROUND_UP_DEVISION(ino->size, BLOCK_SIZE);
-    uint32_t blk_num_new = ROUND_UP_DEVISION((unsigned int)size, BLOCK_SIZE);
-    
-    std::string content;
-    if (blk_num_new < blk_num_ori) {
-        for (uint32_t start = blk_num_new; start < blk_num_ori; start++) {
-            free_block_in_inode(ino, start);
+
+    uint32_t blk_num_new = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t first = off / BLOCK_SIZE;
+    fill_holes(ino, first, std::min(blk_num_ori, blk_num_new), off, end);
+    unshare_blocks(ino, first, std::min(blk_num_ori, blk_num_new));
+    if (blk_num_new > blk_num_ori) {
+        // the blocks between the old end of file and off stay holes
+        uint32_t from = std::max(first, blk_num_ori);
+        if (from > blk_num_ori) {
+            struct index_path p;
+            bzero(&p, sizeof(p));
+            append_blocks(ino, &p, blk_num_ori, 0, from - blk_num_ori);
         }
-    }
-    else if (blk_num_new > blk_num_ori) {
-        for (uint32_t start = blk_num_ori; start < blk_num_new; start++) {
-            alloc_block_in_inode(ino, start, content, false);
+        alloc_blocks_in_inode(ino, from, blk_num_new);
+        // new blocks read back as zeros outside the written range
+        char zero[BLOCK_SIZE];
+        bzero(zero, BLOCK_SIZE);
+        if (off > from * BLOCK_SIZE) {
+            write_bytes(ino, from * BLOCK_SIZE, off - from * BLOCK_SIZE, zero);
+        }
+        if (end % BLOCK_SIZE != 0) {
+            write_bytes(ino, end, BLOCK_SIZE - end % BLOCK_SIZE, zero);
         }
     }
-    ino->size = (unsigned int) size;
-    if (blk_num_new != 0) {
-        uint32_t start = 0;
-        for (; start + 1 < blk_num_new; start++) {
-            content.assign(buf + BLOCK_SIZE * start, BLOCK_SIZE);
-            write_block_in_inode(ino, start, content);
-        }
-        uint32_t padding_bytes = blk_num_new * BLOCK_SIZE - size;
-        uint32_t tail_bytes = BLOCK_SIZE - padding_bytes;
-        content.assign(buf + BLOCK_SIZE * start, tail_bytes);
-        content.resize(BLOCK_SIZE);
-        write_block_in_inode(ino, blk_num_new - 1, content);
+    write_bytes(ino, off, (uint32_t) size, buf);
+    if (end > ino->size) {
+        ino->size = end;
     }
     ino->atime = time(NULL);
     ino->mtime = time(NULL);
     ino->ctime = time(NULL);
     put_inode(inum, ino);
-    free(ino);
+}
+
+/* Cut the file to size bytes, or extend it with a hole. Only the
+ * blocks past the new end are freed, and the tail of the new last
+ * block zeroed; a compressed file is stored as is again first,
+ * unless it is cut to nothing. */
+void
+inode_manager::truncate(uint32_t inum, uint32_t size)
+{
+    if ((uint64_t) size > (uint64_t) MAXFILE * BLOCK_SIZE) {
+        printf("\tim: error! truncate beyond MAXFILE.\n");
+        return;
+    }
+    scoped_op op(this);
+    ScopedLock il(inode_lock(inum));
+    inode *ino = get_inode(inum);
+    if (size == 0) {
+        free_blocks_in_inode(ino, 0);
+        ino->flags = (ino->flags & ~I_COMPRESSED) | I_EXTENTS;
+        ino->csize = 0;
+    } else if (ino->flags & I_COMPRESSED) {
+        uncompress_inode(ino);
+    }
+    uint32_t blk_num_ori = ROUND_UP_DEVISION(ino->size, BLOCK_SIZE);
+    uint32_t blk_num_new = ROUND_UP_DEVISION(size, BLOCK_SIZE);
+    if (blk_num_new < blk_num_ori) {
+        free_blocks_in_inode(ino, blk_num_new);
+    } else if (blk_num_new > blk_num_ori) {
+        struct index_path p;
+        bzero(&p, sizeof(p));
+        append_blocks(ino, &p, blk_num_ori, 0, blk_num_new - blk_num_ori);
+    }
+    if (size < ino->size && size % BLOCK_SIZE != 0) {
+        // what a later write past the end skips must read as zeros
+        uint32_t last = blk_num_new - 1, run;
+        struct index_path p;
+        bzero(&p, sizeof(p));
+        if (map_run(ino, &p, last, &run) != 0) {
+            char zero[BLOCK_SIZE];
+            bzero(zero, BLOCK_SIZE);
+            unshare_blocks(ino, last, last + 1);
+            write_bytes(ino, size, BLOCK_SIZE - size % BLOCK_SIZE, zero);
+        }
+    }
+    ino->size = size;
+    ino->mtime = time(NULL);
+    ino->ctime = time(NULL);
+    put_inode(inum, ino);
 }
 
 void
 inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
 {
+    ScopedLock il(inode_lock(inum));
     inode *ino = get_inode(inum);
     a.type = (uint32_t) ino->type;
     a.atime = ino->atime;
     a.ctime = ino->ctime;
     a.mtime = ino->mtime;
     a.size = ino->size;
-    free(ino);
+}
+
+/* Make the updates so far durable, as far as the disk's sync mode asks. */
+void
+inode_manager::sync()
+{
+    flush_inodes();
+    bm->sync();
 }
 
 void
 inode_manager::remove_file(uint32_t inum)
 {
+    scoped_op op(this);
+    ScopedLock il(inode_lock(inum));
     inode *ino = get_inode(inum);
-    uint32_t size = ino->size;
-    uint32_t block_num = size == 0 ? 0 : ((size - 1) / BLOCK_SIZE + 1);
-    for (uint32_t start = 0; start < block_num; start++) {
-        free_block_in_inode(ino, start);
-    }
+    free_blocks_in_inode(ino, 0);
     free_inode(inum);
-    free(ino);
 }
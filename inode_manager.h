@@ -4,9 +4,16 @@
 #define inode_h
 
 #include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 #include "extent_protocol.h" // TODO: delete it
 
+#ifndef DISK_SIZE
 #define DISK_SIZE  1024*1024*16
+#endif
 #define BLOCK_SIZE 512
 #define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
 
@@ -14,36 +21,173 @@ typedef uint32_t blockid_t;
 
 // disk layer -----------------------------------------
 
+// Block checksums live past the last block of the disk: a header
+// block, then a CRC32C per block.
+#define NCSUM         ((BLOCK_NUM * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define CSUM_MAGIC    0x63726363  // "crcc"
+
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char (*blocks)[BLOCK_SIZE];
+  int fd;
+  int sync_mode;
+  // range of blocks written since the last sync
+  blockid_t dirty_lo, dirty_hi;
+  pthread_mutex_t dirty_mutex;
+  // checksum header and table, right after the blocks
+  bool checksum;
+  uint32_t *csum_header;
+  uint32_t *csums;
+  void mark_dirty(blockid_t lo, blockid_t hi);
+  void init_csums(bool readonly = false);
 
  public:
-  disk();
+  // When the image is flushed to the backing file by sync().
+  enum sync_modes {
+    SYNC_NONE = 0,  // leave it to kernel writeback
+    SYNC_ASYNC,     // start writeback of dirty pages, don't wait
+    SYNC_FULL       // wait for dirty pages to reach the device
+  };
+  // Mount options, or'ed into the sync mode.
+  enum mount_options {
+    SYNC_MASK = 0x0f,
+    CHECKSUM = 0x10, // keep a CRC32C per block and verify it on read
+    COMPRESS = 0x20, // compress file data written by write_file
+    DEDUP = 0x40,    // store blocks of identical content once
+    READONLY = 0x80  // map an existing image read-only, for inspection
+  };
+  // blocks read back with a bad checksum
+  uint64_t bad_reads;
+  // the checksum table matches the blocks; a read-only mount leaves a
+  // stale one alone
+  bool csums_valid;
+
+  disk(int mode = SYNC_NONE);
+  disk(const char *image, int mode);
+  ~disk();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t id, uint32_t n, char *buf);
+  void write_blocks(uint32_t id, uint32_t n, const char *buf);
+  bool verify_block(uint32_t id);
+  void sync();
 };
 
 // block layer -----------------------------------------
 
+#define SB_MAGIC 0x79667338  // "yfs8"
+
 typedef struct superblock {
+  uint32_t magic;
   uint32_t size;
   uint32_t nblocks;
   uint32_t ninodes;
 } superblock_t;
 
+// Shards of the block allocator, each with its own next-fit hint
+#define NSHARD 8
+
+// Redo journal of metadata blocks, right after the inode table: a
+// header block, the home block numbers logged, then their copies.
+#define NJOURNAL      1024
+#define JBLOCK(nblocks)   (IBLOCK(INODE_NUM, nblocks) + 1)
+#define JMAGIC        0x6a726e6c  // "jrnl"
+// A transaction this big commits before more operations join it, so
+// that one still fits in the journal with the operations under way.
+#define JFULL         (NJOURNAL / 4)
+
+// Reference counts of shared data blocks, right after the journal:
+// how many files map each block besides the first one.
+#define RPB           (BLOCK_SIZE / sizeof(uint16_t))
+#define NREFS         ((BLOCK_NUM + RPB - 1) / RPB)
+#define RBLOCK(nblocks)   (JBLOCK(nblocks) + NJOURNAL)
+#define MAXREFS       0xffff
+
+// The journal header; a transaction counts once n is set.
+typedef struct jheader {
+  uint32_t magic;
+  uint32_t n;
+  uint64_t seq;
+} jheader_t;
+
 class block_manager {
  private:
   disk *d;
-  std::map <uint32_t, int> using_blocks;
+  // next-fit hints where the free block scans start, one per shard;
+  // a thread always allocates from the same shard
+  blockid_t alloc_hint[NSHARD];
+  // one lock per bitmap block, block and inode bitmaps alike
+  pthread_mutex_t *bitmap_locks;
+  pthread_mutex_t *bitmap_lock(blockid_t bmblock);
+  blockid_t &shard_hint();
+  void init_bitmap(blockid_t start, uint32_t nbits, uint32_t nreserved);
+
+  // Metadata updates are journaled on an image disk synced with
+  // SYNC_FULL. They collect in the running transaction and reach
+  // their home blocks only once committed; until then reads see them
+  // through the transaction maps.
+  bool journaling;
+  pthread_mutex_t journal_mutex;
+  pthread_cond_t journal_cond;
+  std::map<blockid_t, std::string> running, committing;
+  std::set<blockid_t> forgotten;  // committing blocks rewritten as data
+  // Blocks freed by the running and committing transactions. Data
+  // goes to disk outside the journal, so they are not handed out again
+  // until the free commits: a crash before would replay metadata that
+  // still maps them to their old file.
+  std::set<blockid_t> freed_running, freed_committing;
+  uint64_t reserved_bits(blockid_t base);
+  uint64_t running_seq, committed_seq;
+  int nops;         // operations under way in the running transaction
+  bool draining;    // a commit waits for them to finish
+  bool in_commit;
+  // how long and for how many bytes a commit waits for company
+  uint32_t window_usec, window_bytes;
+  uint64_t running_bytes;
+  void account(uint32_t n);
+  void forget_blocks(blockid_t id, uint32_t n);
+  bool write_journal(uint64_t seq);
+  void replay_journal();
+
+  // Deduplication. Blocks written with dedup on are indexed by the
+  // CRC32C of their content, and left alone from then on; a block
+  // about to be written in place leaves the index first. The index
+  // only knows the blocks written since mount.
+  bool dedup;
+  pthread_mutex_t ref_mutex;
+  std::vector<uint16_t> refs;
+  uint32_t nshared;  // blocks with refs above 0
+  std::multimap<uint32_t, blockid_t> fingerprints;
+  std::map<blockid_t, uint32_t> fingerprint_of;
+  void drop_fingerprint(blockid_t id);
+  void write_refs(blockid_t id);
+  void clear_run(blockid_t start, uint32_t n);
  public:
-  block_manager();
+  block_manager(const char *image = NULL, int sync_mode = disk::SYNC_NONE);
   struct superblock sb;
 
+  uint32_t alloc_bit(blockid_t start, uint32_t nbits, uint32_t &hint);
+  void free_bit(blockid_t start, uint32_t bit);
   uint32_t alloc_block();
   void free_block(uint32_t id);
+  blockid_t alloc_run(blockid_t goal, uint32_t want, uint32_t *got);
+  void free_run(blockid_t start, uint32_t n);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t id, uint32_t n, char *buf);
+  void write_blocks(uint32_t id, uint32_t n, const char *buf);
+  void read_meta_block(uint32_t id, char *buf);
+  void write_meta_block(uint32_t id, const char *buf);
+  bool journaled() { return journaling; }
+  bool journal_full();
+  bool deduping() { return dedup; }
+  blockid_t find_dup(const char *buf);
+  void add_fingerprint(blockid_t id, const char *buf);
+  bool own_blocks(blockid_t id, uint32_t n);
+  void begin_op();
+  void end_op();
+  void set_commit_window(uint32_t usec, uint32_t bytes);
+  void sync();
 };
 
 // inode layer -----------------------------------------
@@ -51,14 +195,22 @@ class block_manager {
 #define INODE_NUM  1024
 
 // Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB           (BLOCK_SIZE / sizeof(struct inode))
+
+// Inode bitmap blocks, covering inums 0..INODE_NUM
+#define NIBMAP        (INODE_NUM/BPB + 1)
+
+// Block containing bit for inode i
+// (BLOCK_NUM/BPB) = Bitmap blocks;
+// 2 = sb + bootcamp
+#define IBMBLOCK(i, nblocks)   ((nblocks)/BPB + (i)/BPB + 2)
 
 // Block containing inode i
 // (BLOCK_NUM/BPB) = Bitmap blocks;
+// NIBMAP = Inode bitmap blocks;
 // 3 = sb + bootcamp + RootInodeBlock(IPB); 
 // i/IPB = inode offset in inode_table
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
+#define IBLOCK(i, nblocks)     ((nblocks)/BPB + NIBMAP + (i)/IPB + 3)
 
 // Bitmap bits per block
 #define BPB           (BLOCK_SIZE*8)
@@ -67,39 +219,142 @@ class block_manager {
 // 2 = sb + bootcamp
 #define BBLOCK(b) ((b)/BPB + 2)
 
-#define NDIRECT 100
+// Bitmap words per block, scanned a word at a time
+#define WPB           (BLOCK_SIZE / sizeof(uint64_t))
+
+#define NDIRECT 12
 #define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// Levels of index blocks: indirect, double- and triple-indirect
+#define NLEVELS 3
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT + \
+                 NINDIRECT * NINDIRECT * NINDIRECT)
+
+// Inode flags
+#define I_EXTENTS 0x1  // blocks[] holds extents, not the block map
+#define I_COMPRESSED 0x2  // the data is stored as compressed chunks
+
+// A compressed file starts with a table of the stored length of
+// each ZCHUNK bytes of data, the chunks follow back to back. A chunk
+// that does not compress is stored as is, with ZRAW set in its length.
+#define ZCHUNK (32 * 1024)
+#define ZRAW 0x80000000
+
+// A run of len contiguous data blocks starting at block start
+struct extent {
+  blockid_t start;
+  uint32_t len;
+};
+// Extents that fit in the block map slots of an inode
+#define NEXTENT ((NDIRECT + NLEVELS) * sizeof(blockid_t) / sizeof(struct extent))
 
+// On-disk inode, packed IPB to a block of the inode table.
 typedef struct inode {
   short type;
+  unsigned short flags;
   unsigned int size;
+  unsigned int csize;  // bytes stored, with I_COMPRESSED
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  // Data block addresses: NDIRECT direct, then the roots of the
+  // indirect, double- and triple-indirect index blocks. With
+  // I_EXTENTS set, up to NEXTENT extents packed from the start
+  // instead, the unused ones zeroed. Block 0 stands for a hole,
+  // which reads back as zeros: a 0 slot, or an extent at block 0.
+  blockid_t blocks[NDIRECT+NLEVELS];
 } inode_t;
 
+// Concurrency: extent_server runs RPCs on a pool of threads, so the
+// layers below lock for themselves.
+//  - Every public inode_manager operation holds the lock of the inode
+//    it works on for its whole duration, so operations on different
+//    files run in parallel and those on one file are serialized.
+//    The inode and its index and data blocks belong to that lock.
+//  - icache_mutex guards the valid and dirty state of the inode cache
+//    and the dirty list; it is taken with an inode lock held, never
+//    the other way round.
+//  - flush_mutex serializes sync, which takes the inode locks one at
+//    a time to copy the inodes out; call it with no inode lock held.
+//  - Each bitmap block has its own lock, held across its
+//    read-modify-write. Threads allocate from different shards of
+//    the block bitmap, so they seldom meet on one.
+//  - With a journal, operations are bracketed by begin_op/end_op,
+//    taken before any inode lock, so that a commit waits for the
+//    operations under way and takes in whole ones only.
+//    journal_mutex is the innermost lock.
+//  - ref_mutex guards the reference counts and the fingerprint
+//    index; only journal_mutex is taken inside it.
+//  - The disk only locks its dirty range; callers never write the
+//    same block concurrently thanks to the locks above.
 class inode_manager {
  private:
   block_manager *bm;
+  bool compress;
+  // next-fit hint: where the next free inode scan starts
+  uint32_t inode_hint;
+  // write-back cache of the inode table, indexed by inum
+  struct cached_inode {
+    struct inode ino;
+    bool valid;
+    bool dirty;
+    pthread_mutex_t lock;
+  };
+  struct cached_inode *icache;
+  std::vector<uint32_t> dirty_inodes;
+  pthread_mutex_t icache_mutex;
+  pthread_mutex_t flush_mutex;
+  pthread_mutex_t itable_mutex;  // inode table writes through the journal
+  pthread_mutex_t *inode_lock(uint32_t inum);
+  // the index blocks on the path to the last block looked up in a
+  // block-mapped inode, one per level, so that walking a file loads
+  // and writes back each index block once
+  struct index_path {
+    blockid_t id[NLEVELS];
+    blockid_t slots[NLEVELS][NINDIRECT];
+    bool dirty[NLEVELS];
+  };
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
+  void flush_inodes();
+  friend struct scoped_op;
+  void begin_op();
+  void end_op();
+  uint32_t read_locked(uint32_t inum, uint32_t off, uint32_t len, char *buf);
   // helpers
-  blockid_t get_blockid_in_inode(struct inode *ino, uint32_t index);
-  void read_block_in_inode(struct inode *ino, uint32_t index, std::string &buf);
-  void write_block_in_inode(struct inode *ino, uint32_t index, std::string &buf);
-  void alloc_block_in_inode(struct inode *ino, uint32_t index, std::string &buf, bool write_through);
-  void free_block_in_inode(struct inode *ino, uint32_t index);
+  int block_path(uint32_t index, uint32_t *root, uint32_t path[NLEVELS]);
+  blockid_t *index_slot(struct inode *ino, struct index_path *p, uint32_t index, bool alloc);
+  void flush_index(struct index_path *p, int l);
+  void free_index(blockid_t ind, int depth, uint32_t keep);
+  uint32_t extent_blocks(struct inode *ino);
+  uint32_t extent_lookup(struct inode *ino, uint32_t index, blockid_t *blk);
+  bool append_extent(struct inode *ino, blockid_t blk, uint32_t n);
+  void extents_to_blockmap(struct inode *ino);
+  blockid_t map_run(struct inode *ino, struct index_path *p, uint32_t index, uint32_t *run);
+  void alloc_blocks_in_inode(struct inode *ino, uint32_t from, uint32_t to);
+  void read_bytes(struct inode *ino, uint32_t off, uint32_t len, char *buf);
+  void write_bytes(struct inode *ino, uint32_t off, uint32_t len, const char *buf);
+  void append_blocks(struct inode *ino, struct index_path *p, uint32_t index, blockid_t blk, uint32_t n);
+  void fill_holes(struct inode *ino, uint32_t from, uint32_t to, uint32_t off, uint32_t end);
+  void unshare_blocks(struct inode *ino, uint32_t from, uint32_t to);
+  void store_bytes(struct inode *ino, const char *buf, uint32_t len);
+  void read_compressed(struct inode *ino, uint32_t off, uint32_t len, char *buf);
+  void uncompress_inode(struct inode *ino);
+  void free_blocks_in_inode(struct inode *ino, uint32_t from);
 
  public:
-  inode_manager();
+  inode_manager(const char *image = NULL, int sync_mode = disk::SYNC_NONE);
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
   void write_file(uint32_t inum, const char *buf, int size);
+  void read_range(uint32_t inum, uint32_t off, uint32_t len, char **buf, int *size);
+  uint32_t read_at(uint32_t inum, uint32_t off, uint32_t len, char *buf);
+  void write_range(uint32_t inum, uint32_t off, const char *buf, int size);
+  void truncate(uint32_t inum, uint32_t size);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
+  void set_commit_window(uint32_t usec, uint32_t bytes) { bm->set_commit_window(usec, bytes); }
+  void sync();
 };
 
 #endif
@@ -0,0 +1,167 @@
+//
+// Journal crash tester
+//
+// Runs a few commits on a journaled image and crashes each run at one
+// more disk sync: the image left behind holds what earlier syncs
+// flushed, plus whatever journal blocks were written since, while the
+// other blocks written since are lost. msync does not order its
+// writes, so that is one of the images a real crash can leave. Once
+// the journal is replayed, the files must be as they were after the
+// last commit, or after the one under way.
+//
+
+#include "inode_manager.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+
+#define NFILE 3
+#define NSTEP 12
+
+const char *img = "journal_tester.img";
+const char *crash_img = "journal_tester.crash.img";
+uint32_t inums[NFILE];
+
+// the mapped image, and its content as of the last sync
+unsigned char *base;
+size_t maplen;
+std::string durable;
+int nsyncs, crash_at, step;
+
+// The content written by step s.
+std::string
+content(int s)
+{
+  return std::string((s * 7919) % 30000 + 1, 'a' + s % 26);
+}
+
+// Whether the files are as they were after step s.
+bool
+files_at(inode_manager *im, int s)
+{
+  for (int f = 0; f < NFILE; f++) {
+    std::string want;
+    for (int t = f; t <= s; t += NFILE)
+      want = content(t);
+    char *buf = NULL;
+    int size = 0;
+    im->read_file(inums[f], &buf, &size);
+    bool same = size == (int) want.size() && memcmp(buf, want.data(), size) == 0;
+    free(buf);
+    if (!same)
+      return false;
+  }
+  return true;
+}
+
+void
+crash()
+{
+  std::string left = durable;
+  blockid_t jb = JBLOCK(BLOCK_NUM);
+  for (blockid_t id = jb; id < jb + NJOURNAL; id++)
+    memcpy(&left[id * BLOCK_SIZE], base + id * BLOCK_SIZE, BLOCK_SIZE);
+  int fd = open(crash_img, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, left.data(), left.size()) != (ssize_t) left.size()) {
+    fprintf(stderr, "error: cannot write %s\n", crash_img);
+    _exit(100);
+  }
+  close(fd);
+  _exit(step);
+}
+
+// disk::sync flushes through here: note what reaches the image.
+extern "C" int
+msync(void *addr, size_t len, int flags) __THROW
+{
+  unsigned char *p = (unsigned char *) addr;
+  if (base && (flags & MS_SYNC) && p >= base && p + len <= base + maplen) {
+    if (++nsyncs == crash_at)
+      crash();
+    memcpy(&durable[p - base], p, len);
+  }
+  return syscall(SYS_msync, addr, len, flags);
+}
+
+// Find where the image is mapped; all of it is on disk by now.
+void
+find_image()
+{
+  char path[4096], line[8192];
+  if (!realpath(img, path)) {
+    fprintf(stderr, "error: no %s\n", img);
+    exit(1);
+  }
+  FILE *maps = fopen("/proc/self/maps", "r");
+  while (maps && fgets(line, sizeof(line), maps)) {
+    unsigned long lo, hi;
+    char *name = strchr(line, '/');
+    if (!name || sscanf(line, "%lx-%lx", &lo, &hi) != 2)
+      continue;
+    name[strcspn(name, "\n")] = 0;
+    if (strcmp(name, path) == 0) {
+      base = (unsigned char *) lo;
+      maplen = hi - lo;
+      break;
+    }
+  }
+  if (maps)
+    fclose(maps);
+  if (!base) {
+    fprintf(stderr, "error: %s is not mapped\n", img);
+    exit(1);
+  }
+  durable.assign((char *) base, maplen);
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  unlink(img);
+  inode_manager *im = new inode_manager(img, disk::SYNC_FULL);
+  for (int f = 0; f < NFILE; f++)
+    inums[f] = im->alloc_inode(extent_protocol::T_FILE);
+  im->sync();
+  delete im;
+
+  for (crash_at = 1; ; crash_at++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      im = new inode_manager(img, disk::SYNC_FULL);
+      find_image();
+      for (step = 0; step < NSTEP; step++) {
+        std::string d = content(step);
+        im->write_file(inums[step % NFILE], d.data(), d.size());
+        im->sync();
+      }
+      _exit(NSTEP);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) > NSTEP) {
+      printf("error: run crashing at sync %d died\n", crash_at);
+      exit(1);
+    }
+    int s = WEXITSTATUS(status);
+    if (s == NSTEP)
+      break;
+    im = new inode_manager(crash_img, disk::SYNC_FULL);
+    bool ok = files_at(im, s - 1) || files_at(im, s);
+    delete im;
+    if (!ok) {
+      printf("error: crash at sync %d in step %d lost a commit\n", crash_at, s);
+      exit(1);
+    }
+  }
+  unlink(img);
+  unlink(crash_img);
+  printf("%d crash points: passed all tests successfully\n", crash_at - 1);
+  return 0;
+}
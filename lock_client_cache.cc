@@ -170,6 +170,8 @@ lock_client_cache::release(lock_protocol::lockid_t lid)
     pthread_mutex_unlock(&threads_mutex);
     /* substantial release */
     ec_handle->sync(lid);
+    if (lu != NULL)
+      lu->dorelease(lid);
     ret = cl->call(lock_protocol::release, lid, id, r);
     pthread_mutex_lock(&threads_mutex);
     lock->client_state = none;
@@ -205,6 +207,8 @@ lock_client_cache::revoke_handler(lock_protocol::lockid_t lid,
     pthread_mutex_unlock(&threads_mutex);
     /* substantial release */
     ec_handle->sync(lid);
+    if (lu != NULL)
+      lu->dorelease(lid);
     ret = cl->call(lock_protocol::release, lid, id, r);
     pthread_mutex_lock(&threads_mutex);
     // schedule to next thread in the queue if it has
@@ -0,0 +1,148 @@
+// LZ4-style block codec. A compressed block is a run of sequences,
+// each a token byte (literal length in the high nibble, match length
+// minus 4 in the low one, 15 meaning more length bytes follow), the
+// literals, and a 2-byte little-endian match offset. The last
+// sequence has literals only.
+
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static inline uint32_t
+load32(const char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t
+hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Append the extra bytes of a length of 15 or more.
+static bool
+put_len(char *dst, int &op, int cap, int len)
+{
+  for (; len >= 255; len -= 255) {
+    if (op >= cap)
+      return false;
+    dst[op++] = (char) 255;
+  }
+  if (op >= cap)
+    return false;
+  dst[op++] = (char) len;
+  return true;
+}
+
+// Emit the literals [anchor, anchor + lit) and, unless mlen is 0, a
+// match of mlen bytes at offset back.
+static bool
+put_seq(const char *src, int anchor, int lit, int back, int mlen,
+        char *dst, int &op, int cap)
+{
+  if (op >= cap)
+    return false;
+  int tok = op++;
+  int ml = mlen ? mlen - MIN_MATCH : 0;
+  dst[tok] = (char) (((lit < 15 ? lit : 15) << 4) | (ml < 15 ? ml : 15));
+  if (lit >= 15 && !put_len(dst, op, cap, lit - 15))
+    return false;
+  if (op + lit > cap)
+    return false;
+  memcpy(dst + op, src + anchor, lit);
+  op += lit;
+  if (mlen == 0)
+    return true;
+  if (op + 2 > cap)
+    return false;
+  dst[op++] = (char) (back & 0xff);
+  dst[op++] = (char) (back >> 8);
+  if (ml >= 15 && !put_len(dst, op, cap, ml - 15))
+    return false;
+  return true;
+}
+
+int
+lz_compress(const char *src, int n, char *dst, int cap)
+{
+  int table[1 << HASH_BITS];
+  int ip = 0, anchor = 0, op = 0;
+
+  memset(table, 0xff, sizeof(table));
+  while (ip + MIN_MATCH <= n) {
+    uint32_t seq = load32(src + ip);
+    uint32_t h = hash(seq);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref < 0 || ip - ref > MAX_OFFSET || load32(src + ref) != seq) {
+      ip++;
+      continue;
+    }
+    int mlen = MIN_MATCH;
+    while (ip + mlen < n && src[ref + mlen] == src[ip + mlen])
+      mlen++;
+    if (!put_seq(src, anchor, ip - anchor, ip - ref, mlen, dst, op, cap))
+      return 0;
+    ip += mlen;
+    anchor = ip;
+  }
+  if (!put_seq(src, anchor, n - anchor, 0, 0, dst, op, cap))
+    return 0;
+  return op;
+}
+
+// Read the extra bytes of a length of 15 or more.
+static bool
+get_len(const unsigned char *src, int &ip, int n, int &len)
+{
+  unsigned char b;
+  do {
+    if (ip >= n)
+      return false;
+    b = src[ip++];
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+int
+lz_decompress(const char *in, int n, char *dst, int cap)
+{
+  const unsigned char *src = (const unsigned char *) in;
+  int ip = 0, op = 0;
+
+  while (ip < n) {
+    int tok = src[ip++];
+    int lit = tok >> 4;
+    if (lit == 15 && !get_len(src, ip, n, lit))
+      return -1;
+    if (lit > n - ip || lit > cap - op)
+      return -1;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n)
+      break;
+    if (ip + 2 > n)
+      return -1;
+    int back = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    int mlen = tok & 15;
+    if (mlen == 15 && !get_len(src, ip, n, mlen))
+      return -1;
+    mlen += MIN_MATCH;
+    if (back == 0 || back > op || mlen > cap - op)
+      return -1;
+    // byte by byte: the match may overlap what it produces
+    for (int i = 0; i < mlen; i++, op++)
+      dst[op] = dst[op - back];
+  }
+  return op;
+}
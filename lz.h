@@ -0,0 +1,15 @@
+// A small LZ4-style codec for compressing file data.
+
+#ifndef lz_h
+#define lz_h
+
+// Compress n bytes at src into dst, which holds cap bytes.
+// Return the compressed length, or 0 if it does not fit.
+int lz_compress(const char *src, int n, char *dst, int cap);
+
+// Decompress n bytes at src into dst, which holds cap bytes.
+// Return the decompressed length, or -1 if the input is malformed
+// or does not fit.
+int lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif
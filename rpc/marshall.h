@@ -209,7 +209,7 @@ unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
 
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+operator<<(marshall &m, const std::vector<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
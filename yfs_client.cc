@@ -1,6 +1,7 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include "slock.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -12,13 +13,11 @@
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
 {
   ec = new extent_client(extent_dst);
-  lc = new lock_client_cache(lock_dst);
+  lc = new lock_client_cache(lock_dst, this);
   lc->ec_handle = ec;
-
-  lc->acquire(1);
-  if (ec->put(1, "") != extent_protocol::OK)
-      printf("error init root dir\n"); // XYB: init root dir
-  lc->release(1);
+  pthread_mutex_init(&dcache_mutex, NULL);
+  // the root dir is created by the extent server when it formats
+  // the disk; don't clobber it here.
 }
 
 
@@ -171,42 +170,59 @@ yfs_client::setattr(inum ino, size_t size)
      * according to the size (<, =, or >) content length.
      */
 
-    std::string buf;
-    
     lc->acquire(ino);
-    r = ec->get(ino, buf);
-    if (r != OK) {
-        lc->release(ino);    
-        return r;
-    }
-    buf.resize(size);
-    r = ec->put(ino, buf);
+    r = ec->truncate(ino, size);
     lc->release(ino);   
 
     return r;
 }
 
+// Add a new file of type named name to parent. A parent not indexed
+// yet is read in the same round trip that creates the file; should
+// the name turn out to be taken, the file goes again.
 int
-yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
+yfs_client::make_entry(inum parent, const char *name, uint32_t type, inum &ino_out)
 {
     int r = OK;
-
-    /*
-     * your code goes here.
-     * note: lookup is what you need to check if file exist;
-     * after create file or dir, you must remember to modify the parent infomation.
-     */
-
     bool found;
 
     lc->acquire(parent);
-    lookup_no_seria(parent, name, found, ino_out);
-    if (found) {
-        lc->release(parent);
-        return EXIST;
+    if (find_indexed(parent, name, found, ino_out)) {
+        if (found) {
+            lc->release(parent);
+            return EXIST;
+        }
+        ec->create(type, ino_out);
+    } else {
+        std::vector<extent_protocol::op> ops(2);
+        std::vector<extent_protocol::result> results;
+        ops[0].code = extent_protocol::get;
+        ops[0].id = parent;
+        ops[0].type = 0;
+        ops[1].code = extent_protocol::create;
+        ops[1].id = 0;
+        ops[1].type = type;
+        if (ec->compound(ops, results) != extent_protocol::OK || results.size() != 2 ||
+            results[0].ret != extent_protocol::OK) {
+            lc->release(parent);
+            return IOERR;
+        }
+        if (results[0].attr.type != extent_protocol::T_DIR) {
+            exit(0);
+        }
+        std::list<dirent> entries;
+        parse_dir(results[0].buf, entries);
+        index_dir(parent, entries);
+        inum made = results[1].id;
+        find_indexed(parent, name, found, ino_out);
+        if (found) {
+            ec->remove(made);
+            lc->release(parent);
+            return EXIST;
+        }
+        ino_out = made;
     }
 
-    ec->create(extent_protocol::T_FILE, ino_out);
     std::string buf, new_entry_str;
     if (ec->get(parent, buf) != extent_protocol::OK) {
         lc->release(parent);
@@ -219,47 +235,34 @@ yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
     new_entry_str.assign((char *) (&new_entry), sizeof(diy_dirent));
     buf.append(new_entry_str);
     ec->put(parent, buf);
+    index_entry(parent, name, ino_out);
     lc->release(parent);
 
     return r;
 }
 
 int
-yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
+yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
-    int r = OK;
-
     /*
      * your code goes here.
-     * note: lookup is what you need to check if directory exist;
+     * note: lookup is what you need to check if file exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
 
-    bool found;
-
-    lc->acquire(parent);
-    lookup_no_seria(parent, name, found, ino_out);
-    if (found) {
-        lc->release(parent);
-        return EXIST;
-    }
-    std::string buf, new_entry_str;
-    if (ec->get(parent, buf) != extent_protocol::OK) {
-        lc->release(parent);
-        exit(0);
-    }
+    return make_entry(parent, name, extent_protocol::T_FILE, ino_out);
+}
 
-    ec->create(extent_protocol::T_DIR, ino_out);
-    struct diy_dirent new_entry;
-    new_entry.inum = ino_out;
-    new_entry.name_length = (unsigned short) strlen(name);
-    memcpy(new_entry.name, name, new_entry.name_length);
-    new_entry_str.assign((char *) (&new_entry), sizeof(diy_dirent));
-    buf.append(new_entry_str);
-    ec->put(parent, buf);
-    lc->release(parent);
+int
+yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
+{
+    /*
+     * your code goes here.
+     * note: lookup is what you need to check if directory exist;
+     * after create file or dir, you must remember to modify the parent infomation.
+     */
 
-    return r;
+    return make_entry(parent, name, extent_protocol::T_DIR, ino_out);
 }
 
 int
@@ -272,15 +275,18 @@ yfs_client:: lookup_no_seria (inum parent, const char *name, bool &found, inum &
      * you should design the format of directory content.
      */
 
+    std::string name_str(name);
+    if (find_indexed(parent, name_str, found, ino_out))
+        return r;
+
+    // not indexed yet: reading the directory indexes it
     std::list<dirent> entries;
     readdir_no_seria(parent, entries);
-    std::string name_str;
-    while (entries.size() != 0) {
-        dirent dir_ent = entries.front();
-        entries.pop_front();
-        if (dir_ent.name == name_str.assign(name, strlen(name))) {
+    std::list<dirent>::iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+        if (it->name == name_str) {
             found = true;
-            ino_out = dir_ent.inum;
+            ino_out = it->inum;
             return r;
         }
     }
@@ -317,6 +323,15 @@ yfs_client:: readdir_no_seria (inum dir, std::list<dirent> &list) {
     if (attr.type != extent_protocol::T_DIR) {
         exit(0);
     }
+    parse_dir(buf, list);
+    index_dir(dir, list);
+    return r;
+}
+
+// Append the entries of directory content buf to list.
+void
+yfs_client::parse_dir(const std::string &buf, std::list<dirent> &list)
+{
     const char *cbuf = buf.c_str();
     unsigned int size = (unsigned int) buf.size();
     unsigned int entry_num = size / (sizeof(diy_dirent));
@@ -328,7 +343,6 @@ yfs_client:: readdir_no_seria (inum dir, std::list<dirent> &list) {
         dirent.name.assign(tmp_entry.name, tmp_entry.name_length);
         list.push_back(dirent);
     }
-    return r;
 }
 
 int
@@ -348,19 +362,13 @@ yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 
     /*
      * your code goes here.
-     * note: read using ec->get().
+     * note: read using ec->read_range().
      */
-    std::string content;
 
     lc->acquire(ino);
-    ec->get(ino, content);
+    r = ec->read_range(ino, off, size, data);
     lc->release(ino);
 
-    if ((unsigned int) off >= content.size()) {
-        data.erase();
-        return r;
-    }
-    data = content.substr(off, size);
     return r;
 }
 
@@ -372,28 +380,17 @@ yfs_client::write(inum ino, size_t size, off_t off, const char *data,
 
     /*
      * your code goes here.
-     * note: write using ec->put().
+     * note: write using ec->write_range().
      * when off > length of original file, fill the holes with '\0'.
      */
 
-    std::string content;
-
-    lc->acquire(ino);
-    ec->get(ino, content);
     std::string buf;
     buf.assign(data, size);
 
-    if ((unsigned int) off <= content.size()) {
-        content.replace(off, size, buf);
-        bytes_written = size;
-    } else {
-        size_t old_size = content.size();
-        content.resize(size + off, '\0');
-        content.replace(off, size, buf);
-        bytes_written = size + off - old_size;
-    }
-    ec->put(ino, content);
+    lc->acquire(ino);
+    r = ec->write_range(ino, off, buf);
     lc->release(ino);
+    bytes_written = size;
 
     return r;
 }
@@ -430,6 +427,10 @@ int yfs_client::rmdir(inum parent, const char *name)
         return NOENT;
     }
     ec->remove(it->inum);
+    {
+        ScopedLock ml(&dcache_mutex);
+        dcache.erase(it->inum);
+    }
     dir_entries.erase(it);
     std::string buf;
     for (it = dir_entries.begin(); it != dir_entries.end(); ++it) {
@@ -443,6 +444,7 @@ int yfs_client::rmdir(inum parent, const char *name)
     }
 
     ec->put(parent, buf);
+    unindex_entry(parent, name_str);
     lc->release(parent);
 
     return r;
@@ -472,10 +474,26 @@ yfs_client::symlink(inum parent, const char *name, const char *link, inum &ino_o
     bool found;
     inum id;
     lookup_no_seria(parent, name, found, id);
-    if (found)
+    if (found) {
+        lc->release(parent);
         return EXIST;
-    r = ec->create(extent_protocol::T_SLINK, ino_out);
-    r = ec->put(ino_out, std::string(link));
+    }
+    // create the link and store its target in one round trip
+    std::vector<extent_protocol::op> ops(2);
+    std::vector<extent_protocol::result> results;
+    ops[0].code = extent_protocol::create;
+    ops[0].id = 0;
+    ops[0].type = extent_protocol::T_SLINK;
+    ops[1].code = extent_protocol::put;
+    ops[1].id = 0;
+    ops[1].type = 0;
+    ops[1].buf = link;
+    r = ec->compound(ops, results);
+    if (r != extent_protocol::OK || results.size() != 2) {
+        lc->release(parent);
+        return IOERR;
+    }
+    ino_out = results[0].id;
     struct diy_dirent sym_entry;
     sym_entry.inum = ino_out;
     sym_entry.name_length = (unsigned short) strlen(name);
@@ -483,7 +501,64 @@ yfs_client::symlink(inum parent, const char *name, const char *link, inum &ino_o
     parent_add.assign((char *) (&sym_entry), sizeof(diy_dirent));
     parent_content += parent_add;
     ec->put(parent, parent_content);
+    index_entry(parent, name, ino_out);
     lc->release(parent);
     return r;
 }
 
+// Index dir by the entries just read from it.
+void
+yfs_client::index_dir(inum dir, const std::list<dirent> &list)
+{
+    ScopedLock ml(&dcache_mutex);
+    dir_index &index = dcache[dir];
+    index.clear();
+    std::list<dirent>::const_iterator it;
+    for (it = list.begin(); it != list.end(); ++it)
+        index[it->name] = it->inum;
+}
+
+// Look name up in the index of dir. Return false if dir is not
+// indexed, leaving found and ino alone.
+bool
+yfs_client::find_indexed(inum dir, const std::string &name, bool &found, inum &ino)
+{
+    ScopedLock ml(&dcache_mutex);
+    std::map<inum, dir_index>::iterator it = dcache.find(dir);
+    if (it == dcache.end())
+        return false;
+    dir_index::iterator e = it->second.find(name);
+    found = e != it->second.end();
+    if (found)
+        ino = e->second;
+    return true;
+}
+
+// Note an entry added to dir, if dir is indexed.
+void
+yfs_client::index_entry(inum dir, const std::string &name, inum ino)
+{
+    ScopedLock ml(&dcache_mutex);
+    std::map<inum, dir_index>::iterator it = dcache.find(dir);
+    if (it != dcache.end())
+        it->second[name] = ino;
+}
+
+// Note an entry removed from dir, if dir is indexed.
+void
+yfs_client::unindex_entry(inum dir, const std::string &name)
+{
+    ScopedLock ml(&dcache_mutex);
+    std::map<inum, dir_index>::iterator it = dcache.find(dir);
+    if (it != dcache.end())
+        it->second.erase(name);
+}
+
+// The lock on lid goes back to the server, and other clients may
+// change the directory from then on.
+void
+yfs_client::dorelease(lock_protocol::lockid_t lid)
+{
+    ScopedLock ml(&dcache_mutex);
+    dcache.erase(lid);
+}
@@ -9,11 +9,14 @@
 //#include "yfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <map>
+#include <tr1/unordered_map>
+#include <pthread.h>
 #include "lock_client_cache.h"
 
 #define MAX_FILENAME_LENGTH 64
 
-class yfs_client {
+class yfs_client : public lock_release_user {
   extent_client *ec;
   lock_client_cache *lc;
  public:
@@ -48,6 +51,19 @@ class yfs_client {
   static inum n2i(std::string);
   int lookup_no_seria(inum parent, const char *name, bool &found, inum &ino_out);
   int readdir_no_seria(inum dir, std::list<dirent> &list);
+  static void parse_dir(const std::string &buf, std::list<dirent> &list);
+  int make_entry(inum parent, const char *name, uint32_t type, inum &ino_out);
+
+  // Name to inum of every entry of each directory read while its lock
+  // was cached here; a name missing from a directory's index is known
+  // not to be there. An index goes when the lock goes back.
+  typedef std::tr1::unordered_map<std::string, inum> dir_index;
+  std::map<inum, dir_index> dcache;
+  pthread_mutex_t dcache_mutex;
+  void index_dir(inum dir, const std::list<dirent> &list);
+  bool find_indexed(inum dir, const std::string &name, bool &found, inum &ino);
+  void index_entry(inum dir, const std::string &name, inum ino);
+  void unindex_entry(inum dir, const std::string &name);
 
  public:
   yfs_client(std::string, std::string);
@@ -72,6 +88,8 @@ class yfs_client {
   bool issymlink(inum);
   int symlink(inum parent, const char *name, const char *link, inum &ino_out);
   int readlink(inum ino, std::string &data);
+
+  void dorelease(lock_protocol::lockid_t);
 };
 
 #endif 